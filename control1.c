@@ -8,7 +8,16 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
-#include <pthread.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "gpio.h"
+#include "protocol.h"
 
 #define IN 0
 #define OUT 1
@@ -19,273 +28,326 @@
 #define UPBUT 17
 #define DOWNBUT 27
 #define TOUCHBUT 22
-#define VALUE_MAX 40
+#define ECHO_TIMEOUT_ms 30 //초음파 에코 대기 한도 (약 5m 왕복)
+#define CHO_HZ 25 //초음파 측정 주기
+#define CHO_MEDIAN 5 //중앙값 필터 크기
+#define CHO_ALPHA 0.4 //지수 이동 평균 계수
+#define CHO_MAX_CM 100 //최대 측정 거리
+#define CHO_RCV_SPEED 50 //이 속도(cm/s) 이상으로 움직이면 반사 강화
+#define HEARTBEAT_ms 250 //입력이 그대로일 때 보내는 주기
+#define MAX_EVENTS 8
 #define swap(a,b) {int c;c=a;a=b;b=c;}
 
-double distance = 0;
 int sock;
+int use_udp; //UDP로 보내는지, 서버가 답하지 않으면 TCP로 돌아간다
 struct sockaddr_in serv_addr;
 int inputsize = 1;
 char sendinfo[5] = {'0','0','0','0','\0'};//각각 위, 아래, 터치, 초음파
 
-static int GPIOExport(int pin) {
-#define BUFFER_MAX 3
-    char buffer[BUFFER_MAX];
-    ssize_t bytes_written;
-    int fd;
-
-    fd = open("/sys/class/gpio/export", O_WRONLY);
-    if (-1 == fd) {
-        fprintf(stderr, "Failed to open export for writing!\n");
-        return -1;
-    }
+GpioLine cho_trig, cho_echo; // 초음파 트리거, 에코
+GpioLine up_line, down_line;  // 위, 아래 버튼
+GpioLine touch_line;          // 터치 센서
 
-    bytes_written = snprintf(buffer, BUFFER_MAX, "%d", pin);
-    write(fd, buffer, bytes_written);
-    close(fd);
-    return 0;
-}
+/* 초음파 거리 측정
+ * CHO_HZ 타이머마다 트리거를 보내고 에코 펄스의 상승, 하강 에지 타임스탬프(CLOCK_MONOTONIC)로 왕복 시간을 잰다
+ * 거리는 중앙값 필터로 튀는 값을 없앤 뒤 지수 이동 평균으로 다듬고, 그 변화량으로 속도를 추정한다
+ */
+typedef struct {
+    double window[CHO_MEDIAN]; // 최근 측정 거리
+    int count;                 // window에 들어간 개수
+    int next;
+    double filtered;           // 필터를 거친 거리 (cm)
+    double velocity;           // 필터를 거친 속도 (cm/s), 센서에서 멀어지면 양수
+    uint64_t last_ts;          // 마지막 측정 시각
+    unsigned long samples;     // 성공한 측정 수
+    unsigned long timeouts;    // 에코가 없던 측정 수
+    int measuring;             // 에코를 기다리는 중인지
+    uint64_t trigger_ts;       // 트리거를 보낸 시각
+    uint64_t start_ts;         // 에코 상승 에지 시각
+} UltraSonic;
 
-static int GPIODirection(int pin, int dir){
-    static const char s_directions_str[] = "in\0out";
+UltraSonic cho;
+int cho_level; // 서버로 보낼 속도 단계 (PROTO_AUX_SPEED_STEP cm/s 단위)
 
-#define DIRECTION_MAX 35
-    char path[DIRECTION_MAX] = "/sys/class/gpio/gpio%d/direction";
-    int fd;
-
-    snprintf(path, DIRECTION_MAX, "/sys/class/gpio/gpio%d/direction", pin);
+static double median_of(const double *v, int n){
+    double sorted[CHO_MEDIAN];
+    memcpy(sorted, v, n * sizeof(double));
+    for(int i = 1; i < n; i++)
+        for(int j = i; j > 0 && sorted[j - 1] > sorted[j]; j--){
+            double c = sorted[j]; sorted[j] = sorted[j - 1]; sorted[j - 1] = c;
+        }
+    return sorted[n / 2];
+}
 
-    fd = open(path, O_WRONLY);
-    if (-1 == fd){
-        fprintf(stderr, "Failed to open gpio direction for writing!\n");
-        return -1;
-    }
+/* cho_update()
+ * 새 거리 측정값을 필터에 넣고 속도 갱신
+ */
+void cho_update(UltraSonic *u, double cm, uint64_t ts){
+    u->window[u->next] = cm;
+    u->next = (u->next + 1) % CHO_MEDIAN;
+    if(u->count < CHO_MEDIAN) u->count++;
+    double med = median_of(u->window, u->count);
 
-    if (-1 == write(fd, &s_directions_str[IN == dir ? 0 : 3], IN == dir ? 2 : 3)){
-        fprintf(stderr, "Failed to set direction!\n");
-        close(fd);
-        return -1;
+    if(u->samples++ == 0){
+        u->filtered = med;
+        u->last_ts = ts;
+        return;
     }
-
-    close(fd);
-    return 0;
+    double dt = (ts - u->last_ts) / 1e9;
+    double prev = u->filtered;
+    u->filtered += CHO_ALPHA * (med - u->filtered);
+    if(dt > 0) u->velocity += CHO_ALPHA * ((u->filtered - prev) / dt - u->velocity);
+    u->last_ts = ts;
 }
 
-static int GPIOWrite(int pin, int value){
-    static const char s_values_str[] = "01";
+/* cho_trigger()
+ * 초음파 타이머, 이전 측정이 끝나지 않았으면 실패로 세고 새로 트리거
+ */
+void cho_trigger(UltraSonic *u){
+    if(u->measuring) u->timeouts++;
+    while(gpio_wait(&cho_echo, 0) > 0); // 지난 측정에서 남은 에지 버림
 
-    char path[VALUE_MAX];
-    int fd;
+    u->trigger_ts = gpio_now_ns();
+    u->start_ts = 0;
+    u->measuring = 1;
+    gpio_write(&cho_trig, 1);
+    usleep(10);
+    gpio_write(&cho_trig, 0);
+}
 
-    snprintf(path, VALUE_MAX, "/sys/class/gpio/gpio%d/value", pin);
-    fd = open(path, O_WRONLY);
-    if (-1 == fd){
-        fprintf(stderr, "Failed to open gpio value for writing!\n");
-        return -1;
+/* cho_echo_edge()
+ * 에코 에지 하나 처리
+ * 반환값: 측정이 끝나 거리와 속도가 갱신되면 1
+ */
+int cho_echo_edge(UltraSonic *u){
+    if(gpio_handle(&cho_echo) <= 0 || !u->measuring || cho_echo.ts_ns < u->trigger_ts) return 0;
+    if(cho_echo.value){
+        u->start_ts = cho_echo.ts_ns;
+        return 0;
     }
+    if(!u->start_ts) return 0;
 
-    if(1 != write(fd, &s_values_str[LOW == value ? 0 : 1], 1)){
-        fprintf(stderr, "Failed to write value!\n");
-        close(fd);
-        return -1;
+    u->measuring = 0;
+    if(cho_echo.ts_ns - u->trigger_ts > ECHO_TIMEOUT_ms * 1000000ULL){
+        u->timeouts++;
+        return 0;
     }
+    double cm = (cho_echo.ts_ns - u->start_ts) / 1e9 / 2 * 34300;
+    if(cm > CHO_MAX_CM) cm = CHO_MAX_CM; //100cm이상은 고정
+    cho_update(u, cm, cho_echo.ts_ns);
 
-    close(fd);
-    return 0;
+    /*센서 확인용 출력*/
+    //printf("cur : %.2fcm filtered : %.2fcm velocity : %.1fcm/s timeouts : %lu\n",cm,u->filtered,u->velocity,u->timeouts);
+
+    // 컨트롤러를 빠르게 움직일수록 반사가 강해진다
+    // 속도는 반사할 때만 PROTO_AUX_SPEED_STEP 단위로 잘라 보내므로 단계가 바뀔 때만 샘플이 바뀐다
+    int speed = (int)fabs(u->velocity);
+    sendinfo[3] = speed >= CHO_RCV_SPEED ? '1' : '0';
+    cho_level = sendinfo[3] == '1' ? speed / PROTO_AUX_SPEED_STEP : 0;
+    if(cho_level > 255) cho_level = 255;
+    return 1;
 }
 
-static int GPIOUnexport(int pin){
-    char buffer[BUFFER_MAX];
-    ssize_t bytes_written;
-    int fd;
+/* 컨트롤러 이벤트 루프
+ * 버튼, 터치, 초음파 에코 GPIO 에지와 초음파 타이머, 하트비트 타이머, 소켓을 epoll 하나로 처리한다
+ * 입력이 바뀌면 바로 보내고, 그대로면 HEARTBEAT_ms마다 한 번만 보낸다
+ * UDP면 잃어버린 패킷을 메우도록 최근 샘플을 함께 싣고 PROTO_UDP_RESEND_ms마다 다시 보낸다
+ */
+enum { EV_UP, EV_DOWN, EV_TOUCH, EV_ECHO, EV_CHO_TIMER, EV_HEARTBEAT, EV_SOCK };
 
-    fd = open("/sys/class/gpio/unexport", O_WRONLY);
-    if (-1 == fd){
-        fprintf(stderr, "Failed to open unexport for writing!\n");
-        return -1;
-    }
+ProtoBatch batch = {0};
+ProtoSample last_sent;
+uint64_t last_send_ns;
+unsigned long sent_change, sent_heartbeat;
 
-    bytes_written = snprintf(buffer, BUFFER_MAX, "%d", pin);
-    write(fd, buffer, bytes_written);
-    close(fd);
-    return 0;
+// 현재 입력을 v2 프로토콜 샘플로 변환
+void make_sample(ProtoSample *sample){
+    memset(sample, 0, sizeof(*sample));
+    if(sendinfo[0]=='1') sample->buttons |= PROTO_BTN_UP;
+    if(sendinfo[1]=='1') sample->buttons |= PROTO_BTN_DOWN;
+    if(sendinfo[2]=='1') sample->buttons |= PROTO_BTN_ULT;
+    if(sendinfo[3]=='1') sample->buttons |= PROTO_BTN_RCV;
+    sample->aux = cho_level;
 }
 
-static int GPIORead(int pin) {
-    char path[VALUE_MAX];
-    char value_str[3];
-    int fd;
-
-    snprintf(path, VALUE_MAX, "/sys/class/gpio/gpio%d/value", pin);
-    fd = open(path, O_RDONLY);
-    if (-1 == fd) {
-        fprintf(stderr, "Failed to open gpio value for reading!\n");
-        return -1;
-    }
+/* tongshin()
+ * 입력이 바뀌었거나 heartbeat면 서버로 전송
+ * 반환값: 서버 연결이 끊기면 -1
+ */
+int tongshin(int heartbeat){
+    ProtoSample sample;
+    make_sample(&sample);
+    uint64_t now_ns = gpio_now_ns();
+    int changed = memcmp(&sample, &last_sent, sizeof(sample)) != 0;
+    uint64_t period_ns = (use_udp ? PROTO_UDP_RESEND_ms : HEARTBEAT_ms) * 1000000ULL;
+    if(!changed && !(heartbeat && now_ns - last_send_ns >= period_ns)) return 0;
 
-    if (-1 == read(fd, value_str, 3)){
-        fprintf(stderr, "Failed to read value!\n");
-        close(fd);
-        return -1;
-    }
+    uint8_t pkt[PROTO_MAX_PACKET];
+    uint32_t now = proto_now_us();
+    proto_batch_add(&batch, &sample, now);
+    int len = use_udp ? proto_batch_encode_redundant(&batch, pkt, now, PROTO_UDP_REDUNDANCY) : proto_batch_encode(&batch, pkt, now);
+    if(write(sock, pkt, len) < 0) return -1;
 
-    close(fd);
-    return atoi(value_str);
-}
-
-void *cho_umpa(){ //초음파 스레드용 포인터함수
-    clock_t start_t, end_t;
-    double time;
-    if(GPIOExport(CHOOUT)==-1 || GPIOExport(CHOIN)==-1){
-        printf("gpio export err\n");
-        exit(0);
-    }
-    usleep(100000);
-    if(GPIODirection(CHOOUT, OUT)==-1||GPIODirection(CHOIN,IN)==-1){
-        printf("gpio direction err\n");
-        exit(0);
-    }
-    GPIOWrite(CHOOUT,0);
-    usleep(10000);
-    double beforedistance = 0; //이전 인식된 거리
-    while(1){
-        if(GPIOWrite(CHOOUT,1)==-1){
-            printf("gpio write/trigger err\n");
-            exit(0);
-        }
-		usleep(10);
-        GPIOWrite(CHOOUT, 0);
-        while(GPIORead(CHOIN)==0) start_t = clock();
-        while(GPIORead(CHOIN)==1) end_t = clock();
-        time = (double)(end_t-start_t)/CLOCKS_PER_SEC;
-        distance = time/2*34000;
-        if(distance > 100) distance = 100; //100cm이상은 고정
-        double distance_delta = distance - beforedistance; // 이전 거리와의 차이로 컨트롤러의 움직임을 감지
-        
-        /*센서 확인용 출력*/
-		//printf("cur : %.2fcm before : %2.fcm delta : %.2fcm\n",distance,beforedistance,distance_delta);
-        
-        beforedistance = distance; //이전 거리 저장
-        if(abs(distance_delta) > 5){ //만약 컨트롤러가 움직인 거리가 5cm 이상이면 (절댓값은 있어도 되고 없어도 된다)
-            sendinfo[3] = '1'; //초음파에 해당되는 부분을 켜준다
-        }
-        else sendinfo[3] = '0';
-		usleep(500000);
-    }
+    /*확인용 출력*/
+    //printf("%s\n",sendinfo);
+    last_sent = sample;
+    last_send_ns = now_ns;
+    if(changed) sent_change++;
+    else sent_heartbeat++;
+    return 0;
 }
 
-void *buttonfunc(){ //위아래 버튼용 포인터함수
-    if(GPIOExport(UPBUT)==-1 || GPIOExport(DOWNBUT)==-1){
-        printf("gpio export err\n");
-        exit(0);
-    }
-    usleep(100000);
-    if(GPIODirection(UPBUT, IN)==-1||GPIODirection(DOWNBUT, IN)==-1){
-        printf("gpio direction err\n");
-        exit(0);
-    }
-    while(1){
-        int upbut = GPIORead(UPBUT);
-        int downbut = GPIORead(DOWNBUT);
-        if(upbut==1){
-            sendinfo[0] = '1';
-        }
-        else sendinfo[0] = '0';
-        if(downbut==1){
-            sendinfo[1] = '1';
-        }
-        else sendinfo[1] = '0';
-    }
+int add_fd(int epfd, int fd, uint32_t events, int tag){
+    struct epoll_event ev = { .events = events, .data.u32 = tag };
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
 }
 
-void *touchfunc(){ //터치 센서용 포인터함수
-    if(GPIOExport(TOUCHBUT)==-1){
-        printf("gpio export err\n");
-        exit(0);
-    }
-    usleep(100000);
-    if(GPIODirection(TOUCHBUT, IN)==-1){
-        printf("gpio direction err\n");
-        exit(0);
-    }
-    while(1){
-        int touchbut = GPIORead(TOUCHBUT);
-        if(touchbut==1){
-            sendinfo[2] = '1';
-        }
-        else sendinfo[2] = '0';
-    }
+// GPIO 백엔드에 맞는 epoll 이벤트
+uint32_t gpio_epoll_events(GpioLine *l){
+    return gpio_poll_events(l) == POLLIN ? EPOLLIN : EPOLLPRI | EPOLLERR;
 }
 
-void *tongshin(){ //통신 담당 포인터함수
-    while(1){
-        /*확인용 출력*/
-		//printf("%s\n",sendinfo);
-
-		usleep(10000); //0.01초 즉 100프레임의 레이트로 데이터를 쓴다
-        write(sock, sendinfo, 5);
-    }
+int make_timer(long period_ns){
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec its = { { 0, period_ns }, { 0, period_ns } };
+    timerfd_settime(fd, 0, &its, NULL);
+    return fd;
 }
 
 int main(int argc, char *argv[]){    
-    pthread_t cho_thread;
-    int chothr;
-    pthread_t but_thread;
-    int butthr;
-    pthread_t tch_thread;
-    int tchthr;
-    pthread_t con_thread;
-    int conthr;
-    int status;
-
-    if (argc != 3)
+    int argi = 1;
+    if(argc > 1 && strcmp(argv[1], "-u") == 0){ //UDP 사용
+        use_udp = 1;
+        argi++;
+    }
+    if (argc - argi != 2 && argc - argi != 3) // 방 번호를 주면 로비 포트로 접속해 방을 지정
     {
-        printf("Usage : %s <IP> <port>\n", argv[0]);
+        printf("Usage : %s [-u] <IP> <port> [room]\n", argv[0]);
         exit(1);
     }
-    
-    sock = socket(PF_INET, SOCK_STREAM, 0);
-    
-    if(sock == -1)
-        printf("socket() error\n");
+    int room = argc - argi == 3 ? atoi(argv[argi+2]) : 0;
+    int send_hello = argc - argi == 3 || use_udp; //UDP에서 TCP로 돌아가도 같은 포트의 로비로 접속
 
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = inet_addr(argv[1]);
-    serv_addr.sin_port = htons(atoi(argv[2]));
+    serv_addr.sin_addr.s_addr = inet_addr(argv[argi]);
+    serv_addr.sin_port = htons(atoi(argv[argi+1]));
+
+    if(use_udp){
+        sock = socket(PF_INET, SOCK_DGRAM, 0);
+        if(sock == -1 || connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1
+           || proto_udp_hello(sock, room, PROTO_ROLE_CTRL1) < 0){
+            printf("no UDP answer, using TCP\n");
+            if(sock != -1) close(sock);
+            use_udp = 0;
+        }
+    }
+
+    if(!use_udp){
+        sock = socket(PF_INET, SOCK_STREAM, 0);
     
-	if(connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr))==-1) // 연결된 이후에 스레드를 나눠준다
-        printf("connect() error");
-        
-    /*역할별 스레드 분리*/
-    chothr = pthread_create(&cho_thread, NULL, cho_umpa, 0);
-    if(chothr < 0){
-        perror("thread create error : ");
-        exit(0);
+        if(sock == -1)
+            printf("socket() error\n");
+    
+        if(connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr))==-1)
+            printf("connect() error");
+
+        int option = 1; //입력이 바뀌면 바로 나가도록 Nagle 끄기
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+
+        if(send_hello){
+            uint8_t hello[PROTO_HELLO_SIZE];
+            write(sock, hello, proto_hello(hello, room, PROTO_ROLE_CTRL1));
+        }
     }
-    butthr = pthread_create(&but_thread, NULL, buttonfunc, 0);
-    if(butthr < 0){
-        perror("thread create error : ");
+
+    if(gpio_open(&cho_trig, CHOOUT, OUT, LOW)==-1 || gpio_open(&cho_echo, CHOIN, IN, LOW)==-1
+       || gpio_open(&up_line, UPBUT, IN, LOW)==-1 || gpio_open(&down_line, DOWNBUT, IN, LOW)==-1
+       || gpio_open(&touch_line, TOUCHBUT, IN, LOW)==-1){
+        printf("gpio open err\n");
         exit(0);
     }
-    tchthr = pthread_create(&tch_thread, NULL, touchfunc, 0);
-    if(tchthr < 0){
-        perror("thread create error : ");
-        exit(0);
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int cho_timer = make_timer(1000000000L / CHO_HZ);
+    int heartbeat_timer = make_timer((use_udp ? PROTO_UDP_RESEND_ms : HEARTBEAT_ms) * 1000000L / 2);
+    if(epfd < 0 || cho_timer < 0 || heartbeat_timer < 0
+       || add_fd(epfd, up_line.fd, gpio_epoll_events(&up_line), EV_UP) < 0
+       || add_fd(epfd, down_line.fd, gpio_epoll_events(&down_line), EV_DOWN) < 0
+       || add_fd(epfd, touch_line.fd, gpio_epoll_events(&touch_line), EV_TOUCH) < 0
+       || add_fd(epfd, cho_echo.fd, gpio_epoll_events(&cho_echo), EV_ECHO) < 0
+       || add_fd(epfd, cho_timer, EPOLLIN, EV_CHO_TIMER) < 0
+       || add_fd(epfd, heartbeat_timer, EPOLLIN, EV_HEARTBEAT) < 0
+       || add_fd(epfd, sock, EPOLLIN | EPOLLRDHUP, EV_SOCK) < 0){
+        perror("epoll setup error");
+        exit(1);
     }
-    conthr = pthread_create(&con_thread, NULL, tongshin, 0);
-    if(conthr < 0){
-        perror("thread create error : ");
-        exit(0);
+
+    sendinfo[0] = up_line.value ? '1' : '0';
+    sendinfo[1] = down_line.value ? '1' : '0';
+    sendinfo[2] = touch_line.value ? '1' : '0';
+    tongshin(1);
+
+    int running = 1;
+    while(running){
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            perror("epoll_wait error");
+            break;
+        }
+        int heartbeat = 0;
+        for(int i = 0; i < n; i++){
+            uint64_t expirations;
+            switch(events[i].data.u32){
+            case EV_UP:
+                gpio_handle(&up_line);
+                sendinfo[0] = up_line.value ? '1' : '0';
+                break;
+            case EV_DOWN:
+                gpio_handle(&down_line);
+                sendinfo[1] = down_line.value ? '1' : '0';
+                break;
+            case EV_TOUCH:
+                gpio_handle(&touch_line);
+                sendinfo[2] = touch_line.value ? '1' : '0';
+                break;
+            case EV_ECHO:
+                cho_echo_edge(&cho);
+                break;
+            case EV_CHO_TIMER:
+                read(cho_timer, &expirations, sizeof(expirations));
+                cho_trigger(&cho);
+                break;
+            case EV_HEARTBEAT:
+                read(heartbeat_timer, &expirations, sizeof(expirations));
+                heartbeat = 1;
+                break;
+            case EV_SOCK: { //서버는 시각 동기화 요청만 보낸다, 연결 종료 확인도 여기서
+                static uint8_t rx[PROTO_MAX_PACKET];
+                static int rx_len;
+                ssize_t len = read(sock, rx + rx_len, sizeof(rx) - rx_len);
+                if(len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) running = 0;
+                if(len > 0){
+                    rx_len += len;
+                    proto_reply_pings(sock, rx, &rx_len, proto_now_us());
+                    if(use_udp || rx_len == sizeof(rx)) rx_len = 0; //UDP는 데이터그램마다 새로
+                }
+                break;
+            }
+            }
+        }
+        // 이번에 처리한 이벤트로 입력이 바뀌었으면 바로 전송
+        if(running && tongshin(heartbeat) < 0) running = 0; //서버 연결이 끊기면 종료
     }
-    
-    pthread_join(con_thread, (void**)&status); // 만약 통신용 스레드가 멈추면 cancel을 통해 전부 멈춘다
-    pthread_cancel(cho_thread);
-    pthread_cancel(but_thread);
-    pthread_cancel(tch_thread);
-    
-    if (GPIOUnexport(UPBUT) == -1||GPIOUnexport(DOWNBUT) == -1||GPIOUnexport(TOUCHBUT) == -1||GPIOUnexport(CHOIN) == -1||GPIOUnexport(CHOOUT) == -1)
-        return 4;
+
+    printf("sent: %lu on change, %lu heartbeat, ultrasonic samples: %lu timeouts: %lu\n", sent_change, sent_heartbeat, cho.samples, cho.timeouts);
+    gpio_close(&up_line);
+    gpio_close(&down_line);
+    gpio_close(&touch_line);
+    gpio_close(&cho_echo);
+    gpio_close(&cho_trig);
     
     return 0;
 }
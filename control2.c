@@ -2,15 +2,20 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
-#include <pthread.h>
-#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
+#include <math.h>
+
+#include "gpio.h"
+#include "protocol.h"
 
 #define Device_Address 0x68  // MPU6050의 I2C 주소
 
@@ -31,198 +36,260 @@
 #define LOW 0
 #define HIGH 1
 #define PIN 14  //GPIO PIN num
-#define VALUE_MAX 40 
+#define SAMPLE_MS 10 // 센서 샘플 주기
+#define HEARTBEAT_ms 250 // 입력이 그대로일 때 보내는 주기
+#define STATUS_ms 1000 // 상태 출력 주기
+
+/* MPU6050 드라이버
+ * 가속도, 온도, 자이로 14바이트를 레지스터 주소 쓰기와 함께 I2C_RDWR 한 번으로 읽는다
+ * FIFO를 켜면 센서가 MPU_FIFO_HZ로 쌓아둔 샘플을 한 번에 비워 온다
+ * 장치 경로가 i2c 장치가 아닌 일반 파일이나 파이프면 녹화된 14바이트 블록을 차례로 읽는다 (시험용)
+ */
+#define FIFO_EN      0x23
+#define INT_STATUS   0x3A
+#define USER_CTRL    0x6A
+#define FIFO_COUNT_H 0x72
+#define FIFO_R_W     0x74
+
+#define MPU_BLOCK 14       // ACCEL_XOUT_H부터 GYRO_ZOUT_L까지
+#define MPU_FIFO_SAMPLE 12 // FIFO 샘플: 가속도 6 + 자이로 6 (온도 제외)
+#define MPU_FIFO_SIZE 1024
+#define MPU_FIFO_MAX 32    // 한 번에 비울 최대 샘플 수
+#define MPU_FIFO_MIN_HZ 32   // 8kHz / 256 (SMPLRT_DIV 최대값) 이상
+#define MPU_FIFO_MAX_HZ 1000
+#define MPU_DEFAULT_PATH "/dev/i2c-1"
+
+typedef struct {
+    int16_t ax, ay, az;
+    int16_t temp;
+    int16_t gx, gy, gz;
+} MpuSample;
+
+typedef struct {
+    int fd;
+    int replay;             // 녹화 파일에서 읽는지
+    int fifo_hz;            // FIFO 샘플 주기, 0이면 직접 읽기
+    int fifo_div;           // 실제로 설정한 SMPLRT_DIV, 샘플 간격은 (fifo_div + 1) / 8kHz
+    unsigned long reads;    // I2C 트랜잭션 수
+    unsigned long samples;  // 읽은 샘플 수
+    unsigned long overflows; // FIFO가 넘쳐 비운 횟수
+} Mpu;
+
+Mpu mpu;
+
+static int mpu_write_reg(Mpu *m, uint8_t reg, uint8_t value){
+    uint8_t buf[2] = { reg, value };
+    return write(m->fd, buf, 2) == 2 ? 0 : -1;
+}
 
-int file;
+/* mpu_read_regs()
+ * reg부터 n바이트를 한 트랜잭션으로 읽기 (주소 쓰기 + 반복 시작 + 읽기)
+ */
+static int mpu_read_regs(Mpu *m, uint8_t reg, uint8_t *out, int n){
+    struct i2c_msg msg[2] = {
+        { .addr = Device_Address, .flags = 0, .len = 1, .buf = &reg },
+        { .addr = Device_Address, .flags = I2C_M_RD, .len = n, .buf = out },
+    };
+    struct i2c_rdwr_ioctl_data xfer = { .msgs = msg, .nmsgs = 2 };
+    m->reads++;
+    return ioctl(m->fd, I2C_RDWR, &xfer) < 0 ? -1 : 0;
+}
 
-void error_handling(char *message){
-    fputs(message,stderr);
-    fputc('\n',stderr);
-    exit(1);
+static int16_t be16(const uint8_t *p){
+    return (int16_t)((p[0] << 8) | p[1]);
 }
 
-void MPU_Init() {
-    // I2C 
-    char buf[2];
-    char *i2cDevice = "/dev/i2c-1";  // I2C 장치 파일 경로
-    if ((file = open(i2cDevice, O_RDWR)) < 0) { //I2C 파일 open
+/* mpu_open()
+ * 센서 초기화, fifo_hz가 0이 아니면 그 주기로 FIFO 샘플링
+ */
+int mpu_open(Mpu *m, const char *path, int fifo_hz){
+    struct stat st;
+    memset(m, 0, sizeof(*m));
+    if ((m->fd = open(path, O_RDWR)) < 0 && (m->fd = open(path, O_RDONLY)) < 0) { //I2C 파일 open
         printf("Unable to open I2C device.\n");
-        exit(1);
+        return -1;
     }
+    fstat(m->fd, &st);
+    m->replay = !S_ISCHR(st.st_mode);
+    if (m->replay) return 0; // 녹화 파일은 FIFO 없이 블록 단위로 재생
 
     // MPU6050으로부터 데이터 읽기 설정
-    if (ioctl(file, I2C_SLAVE, Device_Address) < 0) {
+    if (ioctl(m->fd, I2C_SLAVE, Device_Address) < 0) {
         printf("Unable to select I2C device.\n");
-        close(file);
-        exit(1);
+        close(m->fd);
+        return -1;
     }
-    buf[0] = SMPLRT_DIV;
-    buf[1] = 7;
-    write(file, buf, 2);
-
-    //wake up
-    buf[0] = PWR_MGMT_1;
-    buf[1] = 1;
-    write(file, buf, 2);
-
-    // FSYNC를 비활성화하고 가속도계 및 자이로 대역폭을 각각 44 및 42Hz로 설정
-    buf[0] = CONFIG;
-    buf[1] = 0;
-    write(file, buf, 2);
-
-    // 자이로 풀 스케일 범위를 초당 +/-2000도로 설정
-    buf[0] = GYRO_CONFIG;
-    buf[1] = 24;
-    write(file, buf, 2);
-
-    // Enable interrupt
-    buf[0] = INT_ENABLE;
-    buf[1] = 1;
-    write(file, buf, 2);
-}
-
-int read_raw_data(int addr) { // 센서로부터 raw 값 읽기
-    unsigned char high, low;
-    int value;
-
-    // 레지스터 주소 전송
-    write(file, &(unsigned char){addr}, 1);
-
-    // 데이터 읽기
-    read(file, &high, 1);
-    read(file, &low, 1);
-
-    value = (high << 8) | low;
-
-    // 값 유효한지 확인 및 유효화하기
-    if (value > 32768) {
-        value = value - 65536;
+    // DLPF를 끈 상태라 내부 샘플 주기 8kHz, 8비트 SMPLRT_DIV로 나눈다 (기본 1kHz)
+    // 레지스터에 들어가는 범위는 MPU_FIFO_MIN_HZ..MPU_FIFO_MAX_HZ
+    if (fifo_hz && fifo_hz < MPU_FIFO_MIN_HZ) fifo_hz = MPU_FIFO_MIN_HZ;
+    if (fifo_hz > MPU_FIFO_MAX_HZ) fifo_hz = MPU_FIFO_MAX_HZ;
+    m->fifo_hz = fifo_hz;
+    m->fifo_div = fifo_hz ? 8000 / fifo_hz - 1 : 7;
+    mpu_write_reg(m, SMPLRT_DIV, m->fifo_div);
+    mpu_write_reg(m, PWR_MGMT_1, 1); //wake up
+    mpu_write_reg(m, CONFIG, 0);
+    mpu_write_reg(m, GYRO_CONFIG, 24); // 자이로 풀 스케일 범위를 초당 +/-2000도로 설정
+    mpu_write_reg(m, INT_ENABLE, 1); // Enable interrupt
+
+    if (m->fifo_hz) {
+        mpu_write_reg(m, USER_CTRL, 0x04); // FIFO 초기화
+        mpu_write_reg(m, FIFO_EN, 0x78);   // 가속도, 자이로 XYZ
+        mpu_write_reg(m, USER_CTRL, 0x40); // FIFO 사용
     }
-
-    return value;
-}
-
-static int GPIOExport(int pin){ //GPIO 설정
-    #define BUFFER_MAX 3
-    char buffer[BUFFER_MAX];
-    ssize_t bytes_written;
-    int fd;
-
-    fd = open("/sys/class/gpio/export", O_WRONLY);
-    if(-1 == fd)
-    {
-        fprintf(stderr, "Failed to open export for writing!\n");
-        return(-1);
-    }
-    bytes_written = snprintf(buffer, BUFFER_MAX, "%d", pin);
-    write(fd, buffer, bytes_written);
-    close(fd);
-    return(0);
+    return 0;
 }
 
-static int GPIOUnexport(int pin){ //GPIO 설정
-    char buffer[BUFFER_MAX];
-    ssize_t bytes_written;
-    int fd;
-
-    fd = open("/sys/class/gpio/unexport",O_WRONLY);
-    if(-1 == fd){
-        fprintf(stderr, "Failed to open unexport for writing!\n");
-        return(-1);
+/* mpu_read()
+ * 현재 값 한 샘플 읽기
+ */
+int mpu_read(Mpu *m, MpuSample *s){
+    uint8_t b[MPU_BLOCK];
+    if (m->replay) {
+        ssize_t n = read(m->fd, b, MPU_BLOCK);
+        if (n == 0 && lseek(m->fd, 0, SEEK_SET) == 0) n = read(m->fd, b, MPU_BLOCK); // 파일 끝이면 처음부터
+        if (n != MPU_BLOCK) return -1;
+    } else if (mpu_read_regs(m, ACCEL_XOUT_H, b, MPU_BLOCK) < 0) {
+        return -1;
     }
-    bytes_written = snprintf(buffer, BUFFER_MAX, "%d", pin);
-    write(fd, buffer, bytes_written);
-    close(fd);
-    return(0);
+    s->ax = be16(b);
+    s->ay = be16(b + 2);
+    s->az = be16(b + 4);
+    s->temp = be16(b + 6);
+    s->gx = be16(b + 8);
+    s->gy = be16(b + 10);
+    s->gz = be16(b + 12);
+    m->samples++;
+    return 0;
 }
 
-static int GPIODirection(int pin, int dir){ //GPIO 설정정
-    static const char s_directions_str[] = "in\0out";
-    #define DIRECTION_MAX 35
-    char path[DIRECTION_MAX] = "/sys/class/gpio/gpio%d/direction";
-    int fd;
-    snprintf(path, DIRECTION_MAX, "/sys/class/gpio/gpio%d/direction", pin);
-    fd = open(path, O_WRONLY);
-    if(-1 == fd){
-        fprintf(stderr, "Failed to open gpio direction for writing!\n");
-        return(-1);
+/* mpu_read_fifo()
+ * FIFO에 쌓인 샘플을 오래된 것부터 최대 max개 읽기, FIFO를 안 쓰면 현재 값 하나
+ * 반환값: 읽은 샘플 수, 오류면 -1
+ */
+int mpu_read_fifo(Mpu *m, MpuSample *out, int max){
+    if (!m->fifo_hz) return mpu_read(m, out) < 0 ? -1 : 1;
+
+    uint8_t b[MPU_FIFO_MAX * MPU_FIFO_SAMPLE];
+    if (mpu_read_regs(m, FIFO_COUNT_H, b, 2) < 0) return -1;
+    int count = ((b[0] << 8) | b[1]) / MPU_FIFO_SAMPLE;
+    if (count * MPU_FIFO_SAMPLE >= MPU_FIFO_SIZE - MPU_FIFO_SAMPLE) {
+        // 넘치면 샘플 경계가 어긋나므로 비우고 다시 시작
+        m->overflows++;
+        mpu_write_reg(m, USER_CTRL, 0x44);
+        return 0;
     }
-    if(-1 == write(fd, &s_directions_str[IN == dir? 0 : 3], IN == dir? 2 : 3)){
-        fprintf(stderr, "failed to set direction!\n");
-        close(fd);
-        return(-1);
+    if (count > max) count = max;
+    if (count > MPU_FIFO_MAX) count = MPU_FIFO_MAX;
+    if (!count) return 0;
+    if (mpu_read_regs(m, FIFO_R_W, b, count * MPU_FIFO_SAMPLE) < 0) return -1;
+
+    for (int i = 0; i < count; i++) {
+        const uint8_t *p = b + i * MPU_FIFO_SAMPLE;
+        out[i].ax = be16(p);
+        out[i].ay = be16(p + 2);
+        out[i].az = be16(p + 4);
+        out[i].temp = 0;
+        out[i].gx = be16(p + 6);
+        out[i].gy = be16(p + 8);
+        out[i].gz = be16(p + 10);
     }
-
-    close(fd);
-    return(0);
+    m->samples += count;
+    return count;
 }
 
-static int GPIORead(int pin){ // GPIO 센서 읽기
-    char path[VALUE_MAX];
-    char value_str[3];
-    int fd;
-
-    snprintf(path, VALUE_MAX, "/sys/class/gpio/gpio%d/value", pin);
-    fd = open(path, O_RDONLY);
-    if(-1 == fd){
-        fprintf(stderr, "Failed to open for read\n");
-        return(-1);
-    }
-    if(-1 == read(fd, value_str, 3)){
-        fprintf(stderr, "failed to read value\n");
-        close(fd);
-        return(-1);
-    }
-    close(fd);
-    return(atoi(value_str));
+void error_handling(char *message){
+    fputs(message,stderr);
+    fputc('\n',stderr);
+    exit(1);
 }
 
+GpioLine touch_line; // 터치 센서
+
 int is_touched()
 {
-    return GPIORead(PIN); // 터치 센서 값 읽기
+    // 쌓인 에지를 비우고, 지난번 확인 이후 한 번이라도 눌렸으면 터치로 본다
+    // 메인 루프의 poll이 먼저 처리한 상승 에지도 놓치지 않도록 알린 횟수를 따로 기억한다
+    static unsigned long seen_rises;
+    while(gpio_wait(&touch_line, 0) > 0);
+    int touched = touch_line.value || touch_line.rises != seen_rises;
+    seen_rises = touch_line.rises;
+    return touched;
 }
 
-int gyroZ() //필요한 센서값만 추출출
-{
-    int gyro_z = read_raw_data(GYRO_ZOUT_H);
-    float Gz = gyro_z / 131.0; // 약 -40 ~ 40
-    if(Gz < -30) // 센서값 확인 및 형식화
-    {
-        return -2;
-    }
-    else if(Gz < -5)
-    {
-        return -1;
-    }
-    else if(Gz < 5)
-    {
-        return 0;
+/* 센서 융합
+ * 자이로 Z축 각속도를 적분한 기울기와 가속도계로 구한 기울기를 상보 필터로 합친다
+ * 자이로 바이어스는 시작할 때 가만히 둔 상태에서 재고, 이후에도 정지 상태일 때 천천히 보정한다
+ * 중력이 XY 평면에 충분히 걸리지 않아 가속도계로 Z축 회전을 볼 수 없으면 자이로만 쓰고 0으로 천천히 되돌린다
+ * 결과 기울기를 막대 속도(PROTO_AXIS_ONE 단위)로 연속적으로 바꾼다
+ */
+#define GYRO_LSB 16.4      // +/-2000도/s 범위의 1도/s당 값
+#define ACCEL_LSB 16384.0  // +/-2g 범위의 1g당 값
+#define FUSION_ALPHA 0.98  // 상보 필터에서 자이로 비중
+#define CALIB_SAMPLES 100  // 바이어스 초기 측정 샘플 수
+#define BIAS_RATE 0.002    // 정지 상태 바이어스 보정 계수
+#define STILL_DPS 2.0      // 이보다 느리게 돌면 정지로 본다
+#define LEAK_s 2.0         // 가속도계를 못 쓸 때 기울기를 0으로 되돌리는 시간
+#define DEADZONE_DEG 3.0   // 이 기울기 안은 정지
+#define TILT_FULL_DEG 30.0 // 이 기울기에서 최대 속도
+
+typedef struct {
+    double angle;      // 융합한 기울기 (도), 시작 자세가 0
+    double zero;       // 시작 자세의 가속도계 기울기
+    double bias;       // 자이로 Z 바이어스 (도/s)
+    double rate;       // 바이어스를 뺀 각속도
+    int calib;         // 바이어스 측정에 쓴 샘플 수
+} Fusion;
+
+Fusion fusion;
+
+/* fusion_update()
+ * 샘플 하나 반영, dt는 이전 샘플과의 간격 (초)
+ */
+void fusion_update(Fusion *f, const MpuSample *m, double dt){
+    double gz = m->gz / GYRO_LSB;
+    double ax = m->ax / ACCEL_LSB, ay = m->ay / ACCEL_LSB, az = m->az / ACCEL_LSB;
+    double g_xy = sqrt(ax * ax + ay * ay);
+    double g = sqrt(ax * ax + ay * ay + az * az);
+    int acc_ok = g_xy > 0.5 && fabs(g - 1) < 0.2; // 흔들리는 중이 아니고 중력이 XY 평면에 있음
+    double acc_angle = atan2(ax, ay) * 180 / M_PI;
+
+    if(f->calib < CALIB_SAMPLES){
+        f->bias += (gz - f->bias) / ++f->calib;
+        f->zero = acc_angle;
+        return;
     }
-    else if(Gz < 30)
-    {
-        return 1;
+
+    f->rate = gz - f->bias;
+    if(fabs(f->rate) < STILL_DPS && fabs(g - 1) < 0.05)
+        f->bias += BIAS_RATE * (gz - f->bias);
+
+    double gyro_angle = f->angle + f->rate * dt;
+    if(acc_ok){
+        double diff = remainder(acc_angle - f->zero - gyro_angle, 360.0);
+        f->angle = gyro_angle + (1 - FUSION_ALPHA) * diff;
     }
     else
-    {
-        return 2;
-    }
+        f->angle = gyro_angle * (1 - dt / LEAK_s);
+}
+
+// 기울기를 막대 속도로, 데드존 밖에서 선형
+int fusion_axis(const Fusion *f){
+    double a = fabs(f->angle);
+    if(f->calib < CALIB_SAMPLES || a < DEADZONE_DEG) return 0;
+    double t = (a - DEADZONE_DEG) / (TILT_FULL_DEG - DEADZONE_DEG);
+    if(t > 1) t = 1;
+    int axis = (int)(t * PROTO_AXIS_MAX);
+    return f->angle < 0 ? -axis : axis;
 }
 
-void gyro_all() //모든  센서값 읽기
+void gyro_all(const MpuSample *m) //모든  센서값 출력
 {
-        int acc_x = read_raw_data(ACCEL_XOUT_H);
-        int acc_y = read_raw_data(ACCEL_YOUT_H);
-        int acc_z = read_raw_data(ACCEL_ZOUT_H);
-        int gyro_x = read_raw_data(GYRO_XOUT_H);
-        int gyro_y = read_raw_data(GYRO_YOUT_H);
-        int gyro_z = read_raw_data(GYRO_ZOUT_H);
-
-        float Ax = acc_x / 16384.0;
-        float Ay = acc_y / 16384.0;
-        float Az = acc_z / 16384.0;
-        float Gx = gyro_x / 131.0;
-        float Gy = gyro_y / 131.0;
-        float Gz = gyro_z / 131.0;
+        float Ax = m->ax / 16384.0;
+        float Ay = m->ay / 16384.0;
+        float Az = m->az / 16384.0;
+        float Gx = m->gx / GYRO_LSB;
+        float Gy = m->gy / GYRO_LSB;
+        float Gz = m->gz / GYRO_LSB;
         
         printf("Gx=%.2f°/s\tGy=%.2f°/s\tGz=%.2f°/s\tAx=%.2f g\tAy=%.2f g\tAz=%.2f g\n",
                Gx, Gy, Gz, Ax, Ay, Az);
@@ -230,14 +297,10 @@ void gyro_all() //모든  센서값 읽기
 
 int setupGPIO() //GPIO 설정
 {
-    if(-1 == GPIOExport(PIN))
+    if(-1 == gpio_open(&touch_line, PIN, IN, LOW))
     {
         return(1);
     }
-    if(-1 == GPIODirection(PIN, IN))
-    {
-        return(2);
-    }
     return 0;
 }
 
@@ -275,30 +338,84 @@ void print_bar(int num, int touched) //test용 print 함수
     return;
 }
 
+void usage(const char *prog)
+{
+    printf("Usage : %s [-u] [-d i2c device or recording] [-f fifo hz] <IP> <port> [room]\n",prog);
+    exit(1);
+}
+
 int main(int argc, char** argv) {
     int sock;
     struct sockaddr_in serv_addr;
-    int str_len;
-    int vel = 0;
-    char msg[5] = "0000"; // "Velocity to up, down, istouched, 0"
-    
-    if(argc!=3){ // 실행 시 IP, port 지정해줘야 함
-        printf("Usage : %s <IP> <port>\n",argv[0]);
-        exit(1);
+    ProtoBatch batch = {0}; // 서버로 보낼 v2 프로토콜 샘플
+    uint8_t pkt[PROTO_MAX_PACKET];
+    uint8_t rx[PROTO_MAX_PACKET]; // 서버에서 받은 시각 동기화 요청
+    int rx_len = 0;
+    const char *i2c_path = MPU_DEFAULT_PATH;
+    int fifo_hz = 0;
+    int use_udp = 0;
+
+    int argi = 1; // 옵션: -u UDP 사용, -d 센서 경로, -f FIFO 주기
+    while(argi < argc && argv[argi][0] == '-'){
+        if(strcmp(argv[argi], "-u") == 0){
+            use_udp = 1;
+            argi++;
+            continue;
+        }
+        if(strcmp(argv[argi], "-d") == 0 && argi + 1 < argc) i2c_path = argv[argi + 1];
+        else if(strcmp(argv[argi], "-f") == 0 && argi + 1 < argc){
+            fifo_hz = atoi(argv[argi + 1]);
+            if(fifo_hz != 0 && (fifo_hz < MPU_FIFO_MIN_HZ || fifo_hz > MPU_FIFO_MAX_HZ)){
+                printf("fifo hz must be 0 or %d..%d\n", MPU_FIFO_MIN_HZ, MPU_FIFO_MAX_HZ);
+                exit(1);
+            }
+        }
+        else usage(argv[0]);
+        argi += 2;
     }
+    if(argc-argi!=2 && argc-argi!=3) // 실행 시 IP, port 지정해줘야 함, 방 번호는 로비 포트로 접속할 때만
+        usage(argv[0]);
     
-    MPU_Init();
-    sock = socket(PF_INET, SOCK_STREAM, 0); //server로의 socket 설정
-    if(sock == -1)
-        error_handling("socket() error");
+    int room = argc-argi==3 ? atoi(argv[argi+2]) : 0;
+    int send_hello = argc-argi==3 || use_udp; // UDP에서 TCP로 돌아가도 같은 포트의 로비로 접속
     
+    if(mpu_open(&mpu, i2c_path, fifo_hz) < 0)
+        exit(1);
+
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = inet_addr(argv[1]);
-    serv_addr.sin_port = htons(atoi(argv[2]));  
+    serv_addr.sin_addr.s_addr = inet_addr(argv[argi]);
+    serv_addr.sin_port = htons(atoi(argv[argi+1]));  
+
+    if(use_udp){ // 서버가 HELLO에 답하지 않으면 TCP로
+        sock = socket(PF_INET, SOCK_DGRAM, 0);
+        if(sock == -1 || connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1
+           || proto_udp_hello(sock, room, PROTO_ROLE_CTRL2) < 0){
+            printf("no UDP answer, using TCP\n");
+            if(sock != -1) close(sock);
+            use_udp = 0;
+        }
+    }
+
+    if(!use_udp){
+        sock = socket(PF_INET, SOCK_STREAM, 0); //server로의 socket 설정
+        if(sock == -1)
+            error_handling("socket() error");
     
-    if(connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr))==-1) //서버 연결
-        error_handling("connect() error");
+        if(connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr))==-1) //서버 연결
+            error_handling("connect() error");
+
+        int option = 1; // 입력이 바뀌면 바로 나가도록 Nagle 끄기
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+
+        if(send_hello){ // 방과 역할 지정
+            int len = proto_hello(pkt, room, PROTO_ROLE_CTRL2);
+            if(write(sock, pkt, len) < 0)
+                error_handling("write() error");
+        }
+    }
+    // UDP는 잃어버린 패킷을 메우도록 더 자주, 최근 샘플과 함께 보낸다
+    uint64_t period_ns = (use_udp ? PROTO_UDP_RESEND_ms : HEARTBEAT_ms) * 1000000ULL;
         
     if(setupGPIO()) // GPIO 설정
     {
@@ -306,29 +423,78 @@ int main(int argc, char** argv) {
         return 1;
     }
     printf("Reading Data of Gyroscope and Accelerometer\n");
+    ProtoSample last = {0};
+    uint64_t last_send = 0, last_status = 0;
+    unsigned long sent = 0; // 마지막 출력 뒤로 보낸 패킷 수
+    uint64_t last_read = gpio_now_ns();
     while (1) {
-		printf("touched : %d, Gyroscope: Z=%d\n", is_touched(), -1 * gyroZ());
-        vel = gyroZ();
-        if(vel < 0)
-        {
-            msg[0] = '0' + -1 * vel;
-            msg[1] = '0';
+        // 쌓인 샘플을 모두 융합해 기울기로 막대 속도를 정한다
+        MpuSample m[MPU_FIFO_MAX];
+        int n = mpu_read_fifo(&mpu, m, MPU_FIFO_MAX);
+        if(n < 0)
+            error_handling("sensor read error");
+        uint64_t read_ns = gpio_now_ns();
+        if(n > 0){
+            double dt = mpu.fifo_hz ? (mpu.fifo_div + 1) / 8000.0 : (read_ns - last_read) / 1e9 / n;
+            last_read = read_ns;
+            ProtoSample sample = {0}; // 서버로 보낼 메시지 생성
+            if(is_touched() == 1)
+                sample.buttons |= PROTO_BTN_ULT;
+
+            // FIFO 샘플마다 막대 속도를 구해 바뀐 것만 모아 한 패킷으로 보낸다, 측정 시각은 마지막 샘플에서 dt씩 거슬러 올라간다
+            // UDP는 패킷마다 새 샘플이 하나여야 받는 쪽이 순번을 알 수 있으므로 마지막 샘플만, 배치가 차면 마지막 자리는 마지막 샘플 몫
+            uint32_t now = proto_now_us();
+            int added = 0;
+            for(int i = 0; i < n; i++){
+                fusion_update(&fusion, &m[i], dt);
+                sample.axis = fusion_axis(&fusion);
+                if(i < n - 1 && (use_udp || batch.count >= PROTO_MAX_SAMPLES - 1)) continue;
+                if(sample.axis == last.axis && sample.buttons == last.buttons) continue;
+                proto_batch_add(&batch, &sample, now - (uint32_t)((n - 1 - i) * dt * 1e6));
+                last = sample;
+                added++;
+            }
+
+            // 입력이 바뀌었거나 한동안 안 보냈을 때만 전송
+            uint64_t now_ns = gpio_now_ns();
+            if(!added && now_ns - last_send >= period_ns){
+                proto_batch_add(&batch, &sample, now);
+                added++;
+            }
+            if(added){
+                int len = use_udp ? proto_batch_encode_redundant(&batch, pkt, now, PROTO_UDP_REDUNDANCY) : proto_batch_encode(&batch, pkt, now);
+                if(write(sock, pkt, len) < 0)
+                    error_handling("write() error");
+                last_send = now_ns;
+                sent++;
+            }
+            // 확인용 출력은 STATUS_ms마다 한 번만
+            if(now_ns - last_status >= STATUS_ms * 1000000ULL){
+                printf("touched : %d, tilt : %.1f, rate : %.1f, bias : %.2f, axis : %d, sent : %lu\n", !!(sample.buttons & PROTO_BTN_ULT),
+                       fusion.angle, fusion.rate, fusion.bias, sample.axis, sent);
+                sent = 0;
+                last_status = now_ns;
+            }
         }
-        else
-        {
-            msg[0] = '0';
-            msg[1] = '0' + vel;
+        //print_bar(fusion_axis(&fusion) / PROTO_AXIS_ONE, is_touched());
+        // 다음 샘플까지 대기, 터치가 바뀌면 바로 다시 보내고 서버의 시각 동기화 요청에는 바로 답한다
+        struct pollfd pfd[2] = { { touch_line.fd, gpio_poll_events(&touch_line), 0 }, { sock, POLLIN, 0 } };
+        if(poll(pfd, 2, SAMPLE_MS) > 0){
+            if(pfd[0].revents)
+                gpio_handle(&touch_line);
+            if(pfd[1].revents){
+                ssize_t len = recv(sock, rx + rx_len, sizeof(rx) - rx_len, MSG_DONTWAIT);
+                if(len == 0)
+                    error_handling("server closed");
+                if(len > 0){
+                    rx_len += len;
+                    proto_reply_pings(sock, rx, &rx_len, proto_now_us());
+                    if(use_udp || rx_len == (int)sizeof(rx)) rx_len = 0; // UDP는 데이터그램마다 새로
+                }
+            }
         }
-        msg[2] = '0' + is_touched(); // 서버로 보낼 메시지 생성
-        printf("msg : %s\n", msg);
-        write(sock, msg, strlen(msg));
-        //print_bar(-1 * gyroZ(), is_touched());
-        usleep(30000);
-    }
-    if(-1 == GPIOUnexport(PIN))
-    {
-        return(4);
     }
-    close(file);
+    gpio_close(&touch_line);
+    close(mpu.fd);
     return 0;
 }
@@ -3,11 +3,26 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <wiringPi.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <linux/spi/spidev.h>
+
+#include "protocol.h"
+
+// 개발용
+#define DISABLE_GPIO 0 // wiringPi 없이 빌드 (bitbang 전송 제외, 일반 리눅스에서 fake로 벤치마크)
+
+#if DISABLE_GPIO == 0
+#include <wiringPi.h>
+#endif
 
 // pin 번호
 #define DIN		12
@@ -20,6 +35,7 @@
 #define SCAN_LIMIT		0x0b
 #define SHUTDOWN		0x0c
 #define DISPLAY_TEST	0x0f
+#define NO_OP			0x00 // 데이지 체인에서 값을 바꾸지 않을 MAX7219에 보내는 주소
 
 #define BUFFER_SIZE 256
 
@@ -27,8 +43,23 @@
 #define DISP_HEIGHT	16
 #define DISP_WIDTH	32
 
+#define CHAIN_LEN	4 // CS 하나에 데이지 체인으로 연결된 MAX7219 수
+#define MATRIX_ROWS	8 // MAX7219 하나의 행 수
+
+#define SPI_SPEED_HZ	2000000 // spidev 클럭 (MAX7219 최대 10MHz)
+#define BENCH_FRAMES	1000    // -b 기본 프레임 수
+#define FULL_REFRESH	300     // 노이즈로 MAX7219 값이 틀어져도 복구되도록 N 프레임마다 전체 전송
+#define RENDER_FPS		100     // 도트 매트릭스 갱신 주기 (공 외삽 포함)
+#define STATS_INTERVAL	5       // 수신 통계 출력 주기 (초)
+
 // dotMatrix[cs][slave][row]
-unsigned char dotMatrix[2][4][8];
+unsigned char dotMatrix[2][CHAIN_LEN][MATRIX_ROWS];
+unsigned char sentMatrix[2][CHAIN_LEN][MATRIX_ROWS]; // 마지막으로 MAX7219에 보낸 값
+int sent_valid;                                       // sentMatrix가 실제 표시 내용과 같은지
+
+// 전송 통계
+long long frame_cnt;
+long long row_cnt; // 전송한 행(CS 구간) 수
 
 void error_handling(char *message)
 {
@@ -37,8 +68,54 @@ void error_handling(char *message)
     exit(1);
 }
 
+// MAX7219 Serial-Data Format(16bit)
+// [address(8bit)][data(8bit)]
+unsigned short make_MAX7219(unsigned short address, unsigned short data)
+{
+    return (address << 8) + data;
+}
+
+/* SPI 전송 방식
+ * send()는 CS 하나에 연결된 데이지 체인으로 rows개의 행을 보낸다
+ * words는 rows * CHAIN_LEN개이고 행마다 CS를 내렸다 올려 MAX7219가 값을 반영(latch)한다
+ */
+typedef struct
+{
+    const char *name;
+    const char *default_arg;
+    int (*open)(const char *arg);
+    int (*send)(int cs, const unsigned short *words, int rows);
+    void (*close)(void);
+} SpiTransport;
+
+// 워드 배열을 MSB부터 바이트 배열로
+static void words_to_bytes(const unsigned short *words, int n, unsigned char *out)
+{
+    for (int i = 0; i < n; i++)
+    {
+        out[i * 2] = words[i] >> 8;
+        out[i * 2 + 1] = words[i] & 0xFF;
+    }
+}
+
+#if DISABLE_GPIO == 0
+// bitbang: GPIO로 직접 클럭을 만든다, 비트마다 digitalWrite 3번
+static const int cs_pin[2] = { CS0, CS1 };
+
+static int bitbang_open(const char *arg)
+{
+    (void)arg;
+    if (wiringPiSetup() < 0)
+        return -1;
+    pinMode(DIN, OUTPUT);
+    pinMode(CLK, OUTPUT);
+    pinMode(CS0, OUTPUT);
+    pinMode(CS1, OUTPUT);
+    return 0;
+}
+
 // SPI 통신으로 16bit 전송
-void send_SPI_16bits(unsigned short data)
+static void send_SPI_16bits(unsigned short data)
 {
     for (int i = 16; i > 0; i--)
     {
@@ -50,21 +127,149 @@ void send_SPI_16bits(unsigned short data)
     }
 }
 
-// MAX7219 Serial-Data Format(16bit)에 맞게 전송
-// [address(8bit)][data(8bit)]
-void send_MAX7219(unsigned short address, unsigned short data)
+static int bitbang_send(int cs, const unsigned short *words, int rows)
+{
+    for (int r = 0; r < rows; r++)
+    {
+        digitalWrite(cs_pin[cs], LOW);
+        for (int i = 0; i < CHAIN_LEN; i++)
+            send_SPI_16bits(words[r * CHAIN_LEN + i]);
+        digitalWrite(cs_pin[cs], HIGH);
+    }
+    return 0;
+}
+
+static void bitbang_close(void)
+{
+}
+#endif
+
+// spidev: 커널 SPI 드라이버, CS마다 장치 하나 (<경로>.0, <경로>.1)
+// 전체 행을 SPI_IOC_MESSAGE 한 번으로 보내고 행 사이에는 cs_change로 CS를 올린다
+static int spidev_fd[2] = { -1, -1 };
+
+static int spidev_open(const char *arg)
 {
-    send_SPI_16bits((address << 8) + data);
+    for (int cs = 0; cs < 2; cs++)
+    {
+        char path[64];
+        unsigned char mode = SPI_MODE_0, bits = 8;
+        unsigned int speed = SPI_SPEED_HZ;
+        snprintf(path, sizeof(path), "%s.%d", arg, cs);
+        spidev_fd[cs] = open(path, O_RDWR);
+        if (spidev_fd[cs] < 0)
+        {
+            perror(path);
+            return -1;
+        }
+        if (ioctl(spidev_fd[cs], SPI_IOC_WR_MODE, &mode) < 0 || ioctl(spidev_fd[cs], SPI_IOC_WR_BITS_PER_WORD, &bits) < 0
+            || ioctl(spidev_fd[cs], SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
+        {
+            perror("spidev setup");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int spidev_send(int cs, const unsigned short *words, int rows)
+{
+    unsigned char tx[MATRIX_ROWS][CHAIN_LEN * 2];
+    struct spi_ioc_transfer xfer[MATRIX_ROWS];
+    if (rows > MATRIX_ROWS)
+        return -1;
+
+    memset(xfer, 0, sizeof(xfer));
+    for (int r = 0; r < rows; r++)
+    {
+        words_to_bytes(words + r * CHAIN_LEN, CHAIN_LEN, tx[r]);
+        xfer[r].tx_buf = (unsigned long)tx[r];
+        xfer[r].len = CHAIN_LEN * 2;
+        xfer[r].speed_hz = SPI_SPEED_HZ;
+        xfer[r].bits_per_word = 8;
+        xfer[r].cs_change = r < rows - 1; // 행마다 latch, 마지막 전송 뒤에는 드라이버가 CS를 올린다
+    }
+    return ioctl(spidev_fd[cs], SPI_IOC_MESSAGE(rows), xfer) < 0 ? -1 : 0;
+}
+
+static void spidev_close(void)
+{
+    for (int cs = 0; cs < 2; cs++)
+        if (spidev_fd[cs] >= 0)
+            close(spidev_fd[cs]);
+}
+
+// fake: 파일이나 파이프에 [cs][행 데이터] 형식으로 기록, 하드웨어 없이 프레임 전송 시간 측정용
+static int fake_fd = -1;
+
+static int fake_open(const char *arg)
+{
+    fake_fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fake_fd < 0)
+    {
+        perror(arg);
+        return -1;
+    }
+    return 0;
+}
+
+static int fake_send(int cs, const unsigned short *words, int rows)
+{
+    unsigned char buf[1 + MATRIX_ROWS * CHAIN_LEN * 2];
+    if (rows > MATRIX_ROWS)
+        return -1;
+    buf[0] = cs;
+    words_to_bytes(words, rows * CHAIN_LEN, buf + 1);
+    return write(fake_fd, buf, 1 + rows * CHAIN_LEN * 2) < 0 ? -1 : 0;
+}
+
+static void fake_close(void)
+{
+    if (fake_fd >= 0)
+        close(fake_fd);
+}
+
+static const SpiTransport transports[] = {
+#if DISABLE_GPIO == 0
+    { "bitbang", "", bitbang_open, bitbang_send, bitbang_close },
+#endif
+    { "spidev", "/dev/spidev0", spidev_open, spidev_send, spidev_close },
+    { "fake", "/dev/null", fake_open, fake_send, fake_close },
+};
+
+const SpiTransport *spi; // 사용 중인 전송 방식
+
+/* open_transport()
+ * "이름[:인자]" 형식으로 전송 방식 선택 (예: spidev:/dev/spidev0, fake:/tmp/frames)
+ */
+void open_transport(const char *spec)
+{
+    char name[32];
+    const char *arg = strchr(spec, ':');
+    int len = arg ? arg - spec : (int)strlen(spec);
+    snprintf(name, sizeof(name), "%.*s", len, spec);
+
+    for (unsigned i = 0; i < sizeof(transports) / sizeof(transports[0]); i++)
+    {
+        if (strcmp(transports[i].name, name) != 0)
+            continue;
+        spi = &transports[i];
+        if (spi->open(arg ? arg + 1 : spi->default_arg) < 0)
+            error_handling("transport open error");
+        return;
+    }
+    fprintf(stderr, "unknown transport: %s\n", name);
+    exit(1);
 }
 
 // 초기 설정값을 보내는 함수
 void init_MAX7219(int cs, unsigned short address, unsigned short data)
 {
-    // Daisy-Chain방식으로 연결된 4개의 MAX7219에 데이터를 쓰기 위해 for문에서 64bit(16 * 4) 데이터를 보낸 후 CS핀을 HIGH로 활성화하였다.
-    digitalWrite(cs,LOW);
-    for (int i = 0; i < 4; i++)
-        send_MAX7219(address, data);
-    digitalWrite(cs,HIGH);
+    // Daisy-Chain방식으로 연결된 4개의 MAX7219에 같은 값을 쓰기 위해 64bit(16 * 4) 데이터를 한 번의 CS 구간으로 보낸다
+    unsigned short words[CHAIN_LEN];
+    for (int i = 0; i < CHAIN_LEN; i++)
+        words[i] = make_MAX7219(address, data);
+    spi->send(cs, words, 1);
 }
 
 // 게임 상에서의 x y 좌표를 도트매트릭스 제어에 맞게 변환하여 값을 세팅해준다.
@@ -83,121 +288,539 @@ void set_Matrix(int y, int x)
     dotMatrix[cs][ss][row] |= 1 << (7 - col);
 }
 
+// 범위를 벗어난 좌표는 무시하고 점 하나 표시
+void draw_Dot(int y, int x)
+{
+    if (0 <= y && y < DISP_HEIGHT && 0 <= x && x < DISP_WIDTH)
+        set_Matrix(y, x);
+}
+
+// 세로 막대는 x열의 비트 하나를 y부터 len개 행에 세운다
+void draw_Paddle(int y, int x, int len)
+{
+    if (x < 0 || x >= DISP_WIDTH)
+        return;
+    for (int i = y < 0 ? 0 : y; i < y + len && i < DISP_HEIGHT; i++)
+        set_Matrix(i, x);
+}
+
+// 게임 화면 합성
+void compose_Matrix(int ball_y, int ball_x, int p1_y, int p1_x, int p1_l, int p2_y, int p2_x, int p2_l)
+{
+    memset(dotMatrix, 0, sizeof(dotMatrix));
+    draw_Paddle(p1_y, p1_x, p1_l);
+    draw_Paddle(p2_y, p2_x, p2_l);
+    draw_Dot(ball_y, ball_x);
+}
+
 // dotMatrix에 맞게 도트매트릭스에 출력해준다.
+// 마지막으로 보낸 값과 달라진 digit 레지스터만 보내고, 같은 행의 나머지 MAX7219에는 NO_OP를 보낸다
+// CS마다 바뀐 행을 모아 한 번에 전송
 void update_Matrix()
 {
-    int cs[2] = { CS0, CS1 };
+    unsigned short words[MATRIX_ROWS * CHAIN_LEN];
+    int full = !sent_valid || frame_cnt % FULL_REFRESH == 0;
 
     for (int k = 0; k < 2; k++)
     {
+        int rows = 0;
         for( int i = 1 ; i < 9 ; i++)
         {
-            digitalWrite(cs[k],LOW);
-            for( int j = 0 ; j < 4 ; j++)
+            int changed = 0;
+            for( int j = 0 ; j < CHAIN_LEN ; j++)
             {
-                send_MAX7219(i, dotMatrix[k][j][i - 1]);
+                unsigned char v = dotMatrix[k][j][i - 1];
+                if (full || v != sentMatrix[k][j][i - 1])
+                {
+                    words[rows * CHAIN_LEN + j] = make_MAX7219(i, v);
+                    changed = 1;
+                }
+                else
+                    words[rows * CHAIN_LEN + j] = make_MAX7219(NO_OP, 0);
             }
-            digitalWrite(cs[k],HIGH);
+            rows += changed;
         }
+        if (rows && spi->send(k, words, rows) < 0)
+        {
+            sent_valid = 0;
+            error_handling("transport send error");
+        }
+        row_cnt += rows;
     }
+    memcpy(sentMatrix, dotMatrix, sizeof(dotMatrix));
+    sent_valid = 1;
+    frame_cnt++;
 }
 
 void intHandler(int dummy)
 {
-    send_MAX7219(SHUTDOWN, 0);
+    (void)dummy;
+    init_MAX7219(0, SHUTDOWN, 0);
+    init_MAX7219(1, SHUTDOWN, 0);
+    spi->close();
     exit(0);
 }
 
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* bench_Matrix()
+ * 서버 없이 공이 움직이는 프레임을 frames번 출력하며 프레임 전송 시간 측정
+ */
+void bench_Matrix(int frames)
+{
+    long long total = 0, worst = 0;
+    for (int f = 0; f < frames; f++)
+    {
+        compose_Matrix(f % DISP_HEIGHT, f % DISP_WIDTH, (f / 4) % DISP_HEIGHT, 1, 5, (f / 3) % DISP_HEIGHT, DISP_WIDTH - 2, 5);
+
+        long long start = now_us();
+        update_Matrix();
+        long long elapsed = now_us() - start;
+        total += elapsed;
+        if (elapsed > worst)
+            worst = elapsed;
+    }
+    printf("transport: %s frames: %d avg: %.1fus max: %lldus (%.0f frames/s)\n", spi->name, frames,
+           (double)total / frames, worst, total ? frames * 1e6 / total : 0.0);
+    printf("rows sent: %.2f/frame (full refresh %d), bytes: %.1f/frame\n", (double)row_cnt / frame_cnt,
+           2 * MATRIX_ROWS, (double)row_cnt * CHAIN_LEN * 2 / frame_cnt);
+}
+
+/* 공 위치 외삽
+ * 서버가 키프레임과 공 궤적이 바뀔 때 PROTO_DISP_MOTION을 붙여 보내면 그 사이에는 마지막 공 좌표와 속도로 공을 움직여 그린다
+ * 받은 시각은 네트워크 지연으로 흔들리므로 틱 번호로 틱 0의 로컬 시각을 추정해 기준으로 삼는다
+ * 새 값이 오면 그 시점의 예측과 차이를 MOTION_BLEND_us 동안 줄여가며 보정한다
+ */
+#define MOTION_MAX_us	100000  // 서버에서 아무것도 오지 않은 채 이만큼 지나면 외삽을 멈춘다 (서버 멈춤, 경기 종료)
+#define MOTION_BLEND_us	33000   // 예측 오차를 줄여가는 시간
+#define MOTION_SNAP_DOTS	2       // 오차가 이보다 크면 (득점 후 리셋 등) 보정 없이 새 값으로
+
+typedef struct
+{
+    DispMotion m;
+    int valid;
+    long long base_us;      // 틱 0의 로컬 시각 추정값
+    long long tick_at;      // m.tick의 로컬 시각
+    long long err_h, err_w; // 보정 중인 예측 오차 (내부 단위)
+    long long err_at;       // 오차를 잰 시각
+    long long seen_at;      // 서버에서 화면이나 공 속도를 마지막으로 받은 시각
+} Motion;
+
+// 벽에 반사되는 좌표를 0 ~ size - 1로 접는다
+static long long fold_Wall(long long v, long long size)
+{
+    long long period = 2 * (size - 1);
+    v %= period;
+    if (v < 0)
+        v += period;
+    return v < size ? v : period - v;
+}
+
+// now 시각의 공 위치 (내부 단위), 보정 중인 오차 포함
+static void predict_Motion(const Motion *mo, long long now, long long *h, long long *w)
+{
+    if (now > mo->seen_at + MOTION_MAX_us)
+        now = mo->seen_at + MOTION_MAX_us;
+    long long dt = now - mo->tick_at;
+    *h = fold_Wall(mo->m.h + (long long)mo->m.vh * dt / mo->m.tick_us, (long long)DISP_HEIGHT * mo->m.scale);
+    *w = mo->m.w + (long long)mo->m.vw * dt / mo->m.tick_us;
+
+    long long left = MOTION_BLEND_us - (now - mo->err_at);
+    if (left > 0)
+    {
+        *h += mo->err_h * left / MOTION_BLEND_us;
+        *w += mo->err_w * left / MOTION_BLEND_us;
+    }
+}
+
+/* update_Motion()
+ * 서버가 보낸 공 좌표와 속도 반영
+ * 반환값: 더 새 틱이라 반영했으면 1
+ */
+int update_Motion(Motion *mo, const DispMotion *m, long long now)
+{
+    if (!m->tick_us || !m->scale)
+        return 0;
+    mo->seen_at = now;
+    long long base = now - (long long)m->tick * m->tick_us;
+    // 같은 경기에서 1초 이내로 늦게 온 틱은 버리고, 크게 거꾸로 가면 새 경기
+    int restart = !mo->valid || m->tick + 1000000 / m->tick_us < mo->m.tick;
+    if (!restart && m->tick <= mo->m.tick)
+        return 0;
+
+    long long ph = 0, pw = 0;
+    if (!restart)
+        predict_Motion(mo, now, &ph, &pw);
+
+    // 가장 빨리 도착한 값이 지연이 가장 적으므로 그쪽을 따르되, 시계 차이로 늘어나는 것은 천천히 따라간다
+    if (restart || base < mo->base_us)
+        mo->base_us = base;
+    else
+        mo->base_us += (base - mo->base_us) / 16;
+
+    mo->m = *m;
+    mo->valid = 1;
+    mo->tick_at = mo->base_us + (long long)m->tick * m->tick_us;
+    mo->err_h = mo->err_w = 0;
+    mo->err_at = now;
+    if (!restart)
+    {
+        long long nh, nw;
+        predict_Motion(mo, now, &nh, &nw);
+        long long snap = (long long)MOTION_SNAP_DOTS * m->scale;
+        if (llabs(ph - nh) <= snap && llabs(pw - nw) <= snap)
+        {
+            mo->err_h = ph - nh;
+            mo->err_w = pw - nw;
+        }
+    }
+    return 1;
+}
+
+// 외삽할 공이 있는지 (값이 유효하고 서버에서 마지막으로 받은 뒤 MOTION_MAX_us가 지나지 않음)
+int active_Motion(const Motion *mo, long long now)
+{
+    return mo->valid && now - mo->seen_at < MOTION_MAX_us;
+}
+
+/* ball_Motion()
+ * now 시각의 공 도트 좌표, 막대를 지나치지 않도록 막대 열 사이로 제한
+ */
+void ball_Motion(const Motion *mo, long long now, int p1_x, int p2_x, int *ball_y, int *ball_x)
+{
+    long long h, w;
+    predict_Motion(mo, now, &h, &w);
+    long long lo = (long long)p1_x * mo->m.scale, hi = (long long)p2_x * mo->m.scale - 1;
+    if (w < lo)
+        w = lo;
+    if (w > hi)
+        w = hi;
+    *ball_y = h / mo->m.scale;
+    *ball_x = w / mo->m.scale;
+}
+
+// 수신, 출력 통계
+typedef struct
+{
+    long long received;   // 화면을 갱신한 프레임 수
+    long long rendered;   // 도트 매트릭스에 출력한 화면 수
+    long long dropped;    // 출력되기 전에 더 새 프레임으로 대체된 수
+    long long age_sum;    // 받은 뒤 출력까지 걸린 시간 합 (us)
+    long long age_max;
+    long long stale;      // UDP로 받은 중복, 늦게 도착한 프레임 수
+    long long extrapolated; // 새 프레임 없이 공 외삽으로 출력한 화면 수
+} RecvStats;
+
+void print_stats(const RecvStats *st, const DispDecoder *dec)
+{
+    long long fresh = st->rendered - st->extrapolated;
+    printf("frames: %lld rendered: %lld (extrapolated %lld) dropped: %lld stale: %lld missed seq: %lu age avg: %.0fus max: %lldus\n",
+           st->received, st->rendered, st->extrapolated, st->dropped, st->stale, (unsigned long)dec->missed,
+           fresh ? (double)st->age_sum / fresh : 0.0, st->age_max);
+    fflush(stdout);
+}
+
+void usage(const char *prog)
+{
+    printf("Usage : %s [-u] [-t transport] <IP> <port> [room]\n", prog);
+    printf("        %s [-t transport] -b [frames]\n", prog);
+    printf("transport: ");
+    for (unsigned i = 0; i < sizeof(transports) / sizeof(transports[0]); i++)
+        printf("%s%s", i ? ", " : "", transports[i].name);
+    printf(" (name[:path])\n");
+    exit(1);
+}
+
 int main(int argc, char **argv)
 {
     int sock;
     struct sockaddr_in serv_addr;
-    char buf[BUFFER_SIZE];
+    const char *transport = transports[0].name;
+    int bench = 0;
+    int use_udp = 0;
 
-    signal(SIGINT, intHandler);
-
-    if (wiringPiSetup() < 0)
+    // 옵션: -u UDP 사용, -t 전송 방식, -b 벤치마크
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-')
     {
-        return 1;
+        if (strcmp(argv[argi], "-u") == 0)
+        {
+            use_udp = 1;
+            argi++;
+        }
+        else if (strcmp(argv[argi], "-t") == 0 && argi + 1 < argc)
+        {
+            transport = argv[argi + 1];
+            argi += 2;
+        }
+        else if (strcmp(argv[argi], "-b") == 0)
+        {
+            bench = BENCH_FRAMES;
+            argi++;
+            if (argi < argc && argv[argi][0] != '-')
+                bench = atoi(argv[argi++]);
+        }
+        else
+            usage(argv[0]);
     }
-	
-    pinMode(DIN, OUTPUT);
-    pinMode(CLK, OUTPUT);
-    pinMode(CS0, OUTPUT);
+    if (bench <= 0 && argc - argi != 2 && argc - argi != 3)
+        usage(argv[0]);
+
+    open_transport(transport);
+    signal(SIGINT, intHandler);
 
     // MAX7219 초기 설정
-    init_MAX7219(CS0, DECODE_MODE, 0x00); // Decode Mode - No decode for digits
-    init_MAX7219(CS0, INTENSITY, 0x01); // Intensity - 1/32
-    init_MAX7219(CS0, SCAN_LIMIT, 0x07); // Scan Limit - All Output Port Enable
-    init_MAX7219(CS0, SHUTDOWN, 0x01); // Shutdown - Normal Operation
-    init_MAX7219(CS0, DISPLAY_TEST, 0x00); // Display Test
-
-    init_MAX7219(CS1, DECODE_MODE, 0x00);
-    init_MAX7219(CS1, INTENSITY, 0x01);
-    init_MAX7219(CS1, SCAN_LIMIT, 0x07);
-    init_MAX7219(CS1, SHUTDOWN, 0x01);
-    init_MAX7219(CS1, DISPLAY_TEST, 0x00);
+    init_MAX7219(0, DECODE_MODE, 0x00); // Decode Mode - No decode for digits
+    init_MAX7219(0, INTENSITY, 0x01); // Intensity - 1/32
+    init_MAX7219(0, SCAN_LIMIT, 0x07); // Scan Limit - All Output Port Enable
+    init_MAX7219(0, SHUTDOWN, 0x01); // Shutdown - Normal Operation
+    init_MAX7219(0, DISPLAY_TEST, 0x00); // Display Test
 
-    sleep(1);
+    init_MAX7219(1, DECODE_MODE, 0x00);
+    init_MAX7219(1, INTENSITY, 0x01);
+    init_MAX7219(1, SCAN_LIMIT, 0x07);
+    init_MAX7219(1, SHUTDOWN, 0x01);
+    init_MAX7219(1, DISPLAY_TEST, 0x00);
 
-    if (argc != 3)
+    if (bench > 0)
     {
-        printf("Usage : %s <IP> <port>\n", argv[0]);
-        exit(1);
+        bench_Matrix(bench);
+        spi->close();
+        return 0;
     }
 
-    // 서버와 통신할 socket 생성
-    sock = socket(PF_INET, SOCK_STREAM, 0);
-    if (sock == -1)
-        error_handling("socket() error");
+    sleep(1);
+
+    int room = argc - argi == 3 ? atoi(argv[argi + 2]) : 0;
+    int send_hello = argc - argi == 3 || use_udp; // UDP에서 TCP로 돌아가면 같은 포트의 로비로 접속
+    uint8_t hello[PROTO_HELLO_SIZE];
 
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = inet_addr(argv[1]);
-    serv_addr.sin_port = htons(atoi(argv[2]));
+    serv_addr.sin_addr.s_addr = inet_addr(argv[argi]);
+    serv_addr.sin_port = htons(atoi(argv[argi + 1]));
+
+    // UDP는 서버가 HELLO에 답해야 쓰고, 답이 없으면 같은 포트의 TCP 로비로 접속
+    if (use_udp)
+    {
+        sock = socket(PF_INET, SOCK_DGRAM, 0);
+        if (sock == -1 || connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1
+            || proto_udp_hello(sock, room, PROTO_ROLE_DISP) < 0)
+        {
+            printf("no UDP answer, using TCP\n");
+            if (sock != -1)
+                close(sock);
+            use_udp = 0;
+        }
+    }
+
+    if (!use_udp)
+    {
+        // 서버와 통신할 socket 생성
+        sock = socket(PF_INET, SOCK_STREAM, 0);
+        if (sock == -1)
+            error_handling("socket() error");
+
+        // 서버와 연결
+        if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1)
+            error_handling("connect() error");
 
-    // 서버와 연결
-    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1)
-        error_handling("connect() error");
+        // 방 번호를 주면 로비 포트로 접속한 것으로 보고 방과 역할 지정
+        if (send_hello)
+        {
+            if (write(sock, hello, proto_hello(hello, room, PROTO_ROLE_DISP)) < 0)
+                error_handling("write() error");
+        }
+    }
 	
     int ball_y, ball_x;
     int p1_y, p1_x, p1_l;
     int p2_y, p2_x, p2_l;
-	
+    unsigned char rx[BUFFER_SIZE];
+    int rx_len = 0;
+    DispDecoder dec = { 0 };
+    Motion mo = { 0 };
+
+    // 수신은 논블로킹으로 쌓인 만큼 모두 읽고, 출력은 가장 최근 화면만 한다
+    // 새 화면은 바로 출력하되 RENDER_FPS보다 자주 오면 timerfd로 다음 출력 시각까지 미룬다
+    // 공 속도를 받고 있으면 새 화면이 없어도 RENDER_FPS로 공을 외삽해 다시 그린다
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0)
+        error_handling("fcntl() error");
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timer < 0)
+        error_handling("timerfd error");
+
+    int dirty = 0;            // 다시 그려야 하는지
+    int fresh = 0;            // 출력하지 않은 새 화면이 있는지
+    int armed = 0;            // 타이머가 다음 출력 시각에 맞춰져 있는지
+    long long frame_recv = 0; // 최근 화면을 받은 시각
+    long long last_render = 0;
+    RecvStats st = { 0 };
+    long long next_stats = now_us() + STATS_INTERVAL * 1000000LL;
+    long long next_hello = now_us() + PROTO_UDP_KEEPALIVE_ms * 1000LL;
+
     while (1)
     {
-        // 서버로 부터 데이터 받아오기
-        read(sock, buf, sizeof(buf));
-        ball_y = buf[0]; // 볼 y좌표
-        ball_x = buf[1]; // 볼 x좌표
-        p1_y = buf[2]; // 플레이어1 y좌표
-        p1_x = buf[3]; // 플레이어1 x좌표
-        p1_l = buf[4]; // 플레이어1 막대길이
-        p2_y = buf[5]; // 플레이어2 y좌표
-        p2_x = buf[6]; // 플레이어2 x좌표
-        p2_l = buf[7]; // 플레이어2 막대길이
-
-        memset(dotMatrix, 0, sizeof(dotMatrix));
-		
-        // dotMatrix에 플레이어 막대와 볼 표시하기
-        for (int i = 0; i < DISP_HEIGHT; i++)
-        {
-            for (int j = 0; j < DISP_WIDTH; j++)
+        // UDP면 서버가 등록을 지우지 않도록 주기적으로 HELLO를 다시 보낸다
+        if (use_udp && now_us() >= next_hello)
+        {
+            write(sock, hello, proto_hello(hello, room, PROTO_ROLE_DISP));
+            next_hello += PROTO_UDP_KEEPALIVE_ms * 1000LL;
+        }
+
+        struct pollfd pfd[2] = { { sock, POLLIN, 0 }, { timer, POLLIN, 0 } };
+        if (poll(pfd, 2, use_udp ? PROTO_UDP_KEEPALIVE_ms : -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            error_handling("poll() error");
+        }
+
+        if (pfd[0].revents)
+        {
+            // 서버로 부터 데이터 받아오기, 소켓에 쌓인 것을 모두 비운다
+            while (1)
             {
-                if (i == ball_y && j == ball_x)
-                    set_Matrix(i, j);
-                else if (p1_y <= i && i < p1_y + p1_l && j == p1_x)
-                    set_Matrix(i, j);
-                else if (p2_y <= i && i < p2_y + p2_l && j == p2_x)
-                    set_Matrix(i, j);
+                int n = read(sock, rx + rx_len, sizeof(rx) - rx_len);
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0 && use_udp)
+                    continue; // 서버가 잠시 없을 때의 ECONNREFUSED, 빈 데이터그램
+                if (n <= 0)
+                {
+                    print_stats(&st, &dec);
+                    error_handling("read() error");
+                }
+                rx_len += n;
+
+                // 완성된 프레임만 반영하고 잘린 프레임은 다음 읽기까지 남겨둔다
+                // 변경분 프레임이 이어지므로 모두 해석하되 출력은 마지막 화면만 한다
+                int i = 0;
+                while (i < rx_len)
+                {
+                    ProtoHeader h;
+                    int len = proto_parse(rx + i, rx_len - i, &h);
+                    if (len == 0)
+                        break;
+                    if (len < 0)
+                    {
+                        i++;
+                        continue;
+                    }
+                    // UDP는 순서가 뒤바뀌거나 같은 프레임이 다시 올 수 있으므로 더 새 순번만 받는다
+                    if (use_udp && dec.synced && (h.type == PROTO_DISP_KEY || h.type == PROTO_DISP_DELTA) && !proto_seq_newer(h.seq, dec.seq))
+                        st.stale++;
+                    else if (h.type == PROTO_PING)
+                    {
+                        // 서버 시각 동기화 요청에는 바로 답한다
+                        uint8_t pong[PROTO_PONG_SIZE];
+                        write(sock, pong, proto_pong(pong, rx + i, proto_now_us()));
+                    }
+                    else if (h.type == PROTO_DISP_MOTION)
+                    {
+                        DispMotion m;
+                        disp_motion_decode(rx + i, &m);
+                        update_Motion(&mo, &m, now_us());
+                    }
+                    else if (disp_decode(&dec, rx + i, &h))
+                    {
+                        st.received++;
+                        if (fresh)
+                            st.dropped++; // 출력되기 전에 더 새 화면이 옴
+                        fresh = dirty = 1;
+                        frame_recv = now_us();
+                        mo.seen_at = frame_recv;
+                    }
+                    i += len;
+                }
+                memmove(rx, rx + i, rx_len - i);
+                rx_len -= i;
+                if (use_udp)
+                    rx_len = 0; // 데이터그램 경계를 넘는 패킷은 없다
             }
         }
-		
-        // 실제 도트매트릭스에 출력하기
-        update_Matrix();
-	
-        // 프레임 조절
-        usleep(10000);
+
+        if (pfd[1].revents)
+        {
+            uint64_t expirations;
+            read(timer, &expirations, sizeof(expirations));
+            armed = 0;
+            if (active_Motion(&mo, now_us()))
+                dirty = 1; // 외삽한 공 위치로 다시 그리기
+        }
+
+        long long next_render = last_render + 1000000 / RENDER_FPS;
+        if (dirty && !armed && now_us() < next_render)
+        {
+            struct itimerspec its = { { 0, 0 }, { next_render / 1000000, next_render % 1000000 * 1000 } };
+            timerfd_settime(timer, TFD_TIMER_ABSTIME, &its, NULL);
+            armed = 1;
+        }
+        else if (dirty && !armed)
+        {
+            ball_y = dec.cur.f[DISP_BALL_H]; // 볼 y좌표
+            ball_x = dec.cur.f[DISP_BALL_W]; // 볼 x좌표
+            p1_y = dec.cur.f[DISP_P1_H]; // 플레이어1 y좌표
+            p1_x = dec.cur.f[DISP_P1_W]; // 플레이어1 x좌표
+            p1_l = dec.cur.f[DISP_P1_LEN]; // 플레이어1 막대길이
+            p2_y = dec.cur.f[DISP_P2_H]; // 플레이어2 y좌표
+            p2_x = dec.cur.f[DISP_P2_W]; // 플레이어2 x좌표
+            p2_l = dec.cur.f[DISP_P2_LEN]; // 플레이어2 막대길이
+            long long now = now_us();
+            int moving = !(dec.cur.f[DISP_FLAGS] & DISP_FLAG_HIDE_BALL) && active_Motion(&mo, now);
+            if (moving)
+                ball_Motion(&mo, now, p1_x, p2_x, &ball_y, &ball_x);
+            if (dec.cur.f[DISP_FLAGS] & DISP_FLAG_HIDE_BALL)
+                ball_y = -1; // 궁극기 중에는 공 숨김
+
+            // dotMatrix에 플레이어 막대와 볼 표시하기
+            compose_Matrix(ball_y, ball_x, p1_y, p1_x, p1_l, p2_y, p2_x, p2_l);
+
+            // 실제 도트매트릭스에 출력하기
+            update_Matrix();
+            dirty = 0;
+            last_render = now_us();
+            st.rendered++;
+
+            if (fresh)
+            {
+                // 받은 뒤 출력이 끝날 때까지 걸린 시간
+                long long age = last_render - frame_recv;
+                st.age_sum += age;
+                if (age > st.age_max)
+                    st.age_max = age;
+                fresh = 0;
+
+                // 서버의 입력 -> 화면 지연 추적용 출력 완료 알림
+                uint8_t ack[DISP_ACK_SIZE];
+                write(sock, ack, disp_ack(ack, dec.seq, age));
+            }
+            else
+                st.extrapolated++;
+
+            // 다음 외삽 출력 예약
+            if (moving && !armed)
+            {
+                next_render = last_render + 1000000 / RENDER_FPS;
+                struct itimerspec its = { { 0, 0 }, { next_render / 1000000, next_render % 1000000 * 1000 } };
+                timerfd_settime(timer, TFD_TIMER_ABSTIME, &its, NULL);
+                armed = 1;
+            }
+        }
+
+        if (now_us() >= next_stats)
+        {
+            print_stats(&st, &dec);
+            memset(&st, 0, sizeof(st));
+            next_stats += STATS_INTERVAL * 1000000LL;
+        }
     }
 	
     return (0);
@@ -1,42 +1,65 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <stddef.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/sockios.h>
+
+#include "protocol.h"
 
 // 연결 포트
 
 #define CTRL1_PORT 8080
 #define CTRL2_PORT 8081
 #define DISP_PORT 8082
+#define LOBBY_PORT 8090 // 방 번호를 지정해 접속하는 포트 (PROTO_HELLO)
+#define METRICS_PORT 8099 // 읽기 전용 통계 포트, 127.0.0.1에서만 받는다
 
 // 게임 파라미터
 #define GAME_FPS 60          // 초당 게임 프레임 수
 #define DISP_FPS 30          // 초당 디스플레이 프레임 수
-#define INPUT_DELAY_us 10000 // 컨트롤러 입력 처리 주기 (마이크로초 단위)
+#define CONSOLE_FPS 10       // 초당 콘솔 출력 횟수
 #define SCALE 100            // 속도 단위
+#define MAX_CATCHUP_STEPS 5  // 지연 발생 시 한 번에 몰아서 처리할 최대 물리 스텝 수
+#define SPEED_FPS 60         // 공과 막대 속도 값의 기준 프레임 수, GAME_FPS를 바꿔도 실제 속도는 같다
 
 // 개발용
 #define DISABLE_SOCK 0    // 컨트롤러 없이 게임 실행
 #define DISABLE_DISP 0    // 도트 매트릭스 출력 안함
 #define DISABLE_LCD 0     // LCD 출력 안함
 #define DISPLAY_CONSOLE 1 // 콘솔 출력 여부
+#define DISP_MOTION 1     // 키프레임과 공 궤적이 바뀐 프레임에 공 속도를 붙여 보냄 (디스플레이가 공 위치 외삽)
 
 // 플레이 요소
 #define GAME_TIME 60       // 게임 시간 (초)
-#define BALL_SPEED 20      // 1 = 프레임당 0.01픽셀
+#define BALL_SPEED 20      // 1 = 기준 프레임당 0.01픽셀
 #define PADDLE_SPEED 50    // 기본 막대 속도
 #define PADDLE_REFLECT 100 // 막대에 맞은 공의 반사 속도 계수 (%)
+#define RCV_REFLECT_MAX 300 // 초음파 반사 강화의 최대 계수 (%)
+#define RCV_FULL_SPEED 200  // 컨트롤러를 이 속도(cm/s) 이상으로 움직이면 최대 계수
 #define PLAYER_POS 1       // 끝에서 N칸 떨어진 위치
 #define PLAYER_LEN 5       // 기본 막대 길이
-#define ULT_FRAME 120      // 궁극기 지속 프레임
+#define ULT_FRAME (GAME_FPS * 2) // 궁극기 지속 프레임
 
 // 고정값
 #define DISP_HEIGHT 16 // 가로로 눕힌 도트 매트릭스로 가정
@@ -44,8 +67,11 @@
 
 // 자동 계산되는 값
 #define MAX_GAME_FRAME (GAME_FPS * GAME_TIME)   // 총 게임 프레임
+#define TICK_SPEED(v) ((v) * SPEED_FPS / GAME_FPS) // 기준 프레임당 속도 -> 틱당 이동량
 #define FRAME_TIME_us (1000000 / GAME_FPS)      // 마이크로초 단위
+#define FRAME_TIME_ns (1000000000LL / GAME_FPS) // 나노초 단위
 #define DISP_FRAME_TIME_us (1000000 / DISP_FPS) // 마이크로초 단위
+#define DISP_SLOT(frame) ((frame) * DISP_FPS / GAME_FPS) // 프레임이 속한 디스플레이 전송 구간
 #define HEIGHT (SCALE * DISP_HEIGHT)            // 내부 처리용 단위
 #define WIDTH (SCALE * DISP_WIDTH)              //
 #define PADDLE_POS (SCALE * PLAYER_POS)         // 막대 위치 내부값
@@ -140,6 +166,7 @@ typedef struct {
 typedef struct {
     int frame;    // 프레임 카운터
     int gameover; // 게임 오버 플래그
+    uint64_t rng; // 경기별 난수 상태, init_game에서 한 번만 시드
 
     Ball ball;
     Player player1;
@@ -151,15 +178,22 @@ int translate_dot(int x) {
     return x / SCALE;
 }
 
+// 경기별 난수 (splitmix64), 같은 시드면 같은 경기가 재현된다
+uint64_t rng_next(uint64_t *s) {
+    uint64_t z = (*s += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
 void reset_ball(GameState *state) {
     // 공 위치 초기화
     state->ball.h = HEIGHT / 2;
     state->ball.w = WIDTH / 2;
     int ball_v = BALL_SPEED;
-    srand(time(NULL));
-    int ball_angle = ((rand() % 91) + 45) + ((rand() % 2) * 180); // 45도 ~ 135도, 225도 ~ 315도
+    int ball_angle = ((rng_next(&state->rng) % 91) + 45) + ((rng_next(&state->rng) % 2) * 180); // 45도 ~ 135도, 225도 ~ 315도
     while (ball_angle % 90 < 10)
-        ball_angle = ((rand() % 91) + 45) + ((rand() % 2) * 180); // 지나치게 수평/수직이면 다시 뽑기
+        ball_angle = ((rng_next(&state->rng) % 91) + 45) + ((rng_next(&state->rng) % 2) * 180); // 지나치게 수평/수직이면 다시 뽑기
     state->ball.vh = ball_v * cos(M_PI / 180.0 * ball_angle);
     state->ball.vw = ball_v * sin(M_PI / 180.0 * ball_angle);
 
@@ -167,86 +201,221 @@ void reset_ball(GameState *state) {
     state->ball.boost_cnt = 0;
 }
 
-int sock_listen;                  // 소켓 연결 스레드 종료 플래그
-int ctrl1_connect, ctrl2_connect; // 컨트롤러 연결 여부
-int ctrl1_v, ctrl2_v;             // 컨트롤러 막대 속도
-int ctrl1_ult, ctrl2_ult;         // 컨트롤러 궁극기 입력
-int ctrl1_rcv;                    // 컨트롤러1 초음파 반사
-
-/* handle_ctrl()
- * 컨트롤러 연결 처리 쓰레드
+/* 통계 값
+ * 값마다 쓰는 쓰레드는 하나뿐이고 다른 쓰레드(통계 포트)는 읽기만 하므로 relaxed 읽기/쓰기로 충분하다
+ * 원자적 덧셈(lock 접두사)이 아니라 일반 load/store로 컴파일되므로 켜두어도 비용이 없다
  */
-void *handle_ctrl(void *arg) {
-    int port = *(int *)arg;
-    int server_fd;
+typedef _Atomic uint64_t stat_t;
+#define STAT_GET(v) atomic_load_explicit(&(v), memory_order_relaxed)
+#define STAT_SET(v, x) atomic_store_explicit(&(v), (x), memory_order_relaxed)
+#define STAT_ADD(v, n) STAT_SET(v, STAT_GET(v) + (n))
 
-    // 라즈베리파이 소켓 설정
-    struct sockaddr_in server_address;
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(port);
-    server_address.sin_addr.s_addr = INADDR_ANY;
+// 통계용 히스토그램 (마이크로초 단위, 2의 거듭제곱 구간마다 8개 세부 구간)
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB_COUNT * 32)
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("Error opening socket for controller");
-        pthread_exit(NULL);
+typedef struct {
+    stat_t count;
+    stat_t sum;
+    stat_t max;
+    _Atomic uint32_t bucket[HIST_BUCKETS];
+} Histogram;
+
+// 단조 증가 시계 (나노초 단위)
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int hist_index(uint64_t v) {
+    if (v < HIST_SUB_COUNT) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int idx = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) | (int)((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// 구간의 하한값
+uint64_t hist_value(int idx) {
+    if (idx < HIST_SUB_COUNT) return idx;
+    int shift = (idx >> HIST_SUB_BITS) - 1;
+    return (uint64_t)(HIST_SUB_COUNT | (idx & (HIST_SUB_COUNT - 1))) << shift;
+}
+
+void hist_record(Histogram *h, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    STAT_ADD(h->count, 1);
+    STAT_ADD(h->sum, us);
+    if (us > STAT_GET(h->max)) STAT_SET(h->max, us);
+    STAT_ADD(h->bucket[hist_index(us)], 1);
+}
+
+// 다른 쓰레드가 읽는 중일 수 있으므로 memset 대신 필드마다 비운다
+void hist_reset(Histogram *h) {
+    STAT_SET(h->count, 0);
+    STAT_SET(h->sum, 0);
+    STAT_SET(h->max, 0);
+    for (int i = 0; i < HIST_BUCKETS; i++) STAT_SET(h->bucket[i], 0);
+}
+
+// 기록 중인 히스토그램을 다른 쓰레드가 읽으면 count와 구간 합이 조금 어긋날 수 있다
+uint64_t hist_percentile(Histogram *h, double p) {
+    uint64_t count = STAT_GET(h->count);
+    if (count == 0) return 0;
+    uint64_t target = (uint64_t)(count * p / 100.0);
+    uint64_t acc = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        acc += STAT_GET(h->bucket[i]);
+        if (acc > target) return hist_value(i);
     }
+    return STAT_GET(h->max);
+}
 
-    if (bind(server_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
-        perror("Error binding socket for controller");
-        close(server_fd);
-        pthread_exit(NULL);
+void hist_dump(const char *name, Histogram *h) {
+    uint64_t count = STAT_GET(h->count);
+    printf("%-8s n=%llu avg=%lluus p50=%lluus p90=%lluus p99=%lluus max=%lluus\n", name,
+           (unsigned long long)count, (unsigned long long)(count ? STAT_GET(h->sum) / count : 0),
+           (unsigned long long)hist_percentile(h, 50), (unsigned long long)hist_percentile(h, 90),
+           (unsigned long long)hist_percentile(h, 99), (unsigned long long)STAT_GET(h->max));
+    // 0이 아닌 구간만 출력
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        uint32_t n = STAT_GET(h->bucket[i]);
+        if (n == 0) continue;
+        printf("  >=%8lluus : %u\n", (unsigned long long)hist_value(i), n);
     }
+}
 
-    listen(server_fd, 5);
+/* 플레이어별 입력 큐
+ * 리액터(생산자) -> 게임 루프(소비자) 단일 생산자/단일 소비자 링 버퍼
+ * 게임 루프는 매 틱 지난 틱 이후 들어온 이벤트를 모두 모아서 반영한다
+ */
+#define INPUT_QUEUE_SIZE 64 // 2의 거듭제곱
 
-    // 컨트롤러 연결 대기
-    int client_fd;
-    struct sockaddr_in client_address;
-    socklen_t client_address_size = sizeof(client_address);
-    client_fd = accept(server_fd, (struct sockaddr *)&client_address, &client_address_size);
-    if (client_fd < 0) {
-        perror("Error accepting controller connection");
-        close(server_fd);
-        pthread_exit(NULL);
+typedef struct {
+    uint64_t t_recv; // 서버 수신 시각
+    uint32_t t_sent; // 컨트롤러 측정 시각 (서버 시계로 옮긴 값, 마이크로초 하위 32비트), 모르면 0
+    uint16_t seq;    // 패킷 순번
+    int axis;        // 막대 속도 (PROTO_AXIS_ONE 단위)
+    int ult;         // 궁극기
+    int rcv;         // 초음파 반사, 컨트롤러를 움직인 속도 (cm/s), 0이면 없음
+} InputEvent;
+
+typedef struct {
+    int axis;
+    int ult;
+    int rcv;
+} PlayerInput;
+
+/* 입력 -> 화면 지연 추적
+ * 게임 루프가 입력 변화(막대 방향, 궁극기, 초음파를 새로 누름)를 반영하면 그 샘플을 추적 대상으로 상태와 함께 게시하고
+ * 리액터는 그 뒤 처음 보내는 디스플레이 프레임 순번을 기억해 두었다가 디스플레이의 PROTO_DISP_ACK로 출력 완료 시각을 받는다
+ * 구간별 시간은 방별 히스토그램에 모아 경기가 끝나면 출력한다
+ * 컨트롤러와 디스플레이 시각은 PROTO_PING으로 잰 시계 차이로 서버 시계로 옮긴다 (동기화 전에는 같은 시계로 본다)
+ */
+#define TRACE_TIMEOUT_ms 1000 // 이 시간 안에 화면에 나오지 않은 추적은 버린다
+
+typedef struct {
+    uint32_t id;        // 0이면 없음
+    uint32_t t_origin;  // 컨트롤러 측정 시각 (서버 시계, 마이크로초)
+    uint64_t t_recv;    // 서버 수신 시각
+    uint64_t t_applied; // get_input이 반영한 시각
+} InputTrace;
+
+typedef struct {
+    InputEvent ev[INPUT_QUEUE_SIZE];
+    atomic_uint head; // 생산자가 다음에 쓸 위치
+    atomic_uint tail; // 소비자가 다음에 읽을 위치
+
+    // 생산자 통계
+    stat_t pushed;        // 들어온 이벤트 수
+    stat_t dropped;       // 큐가 가득 차 버린 이벤트 수
+
+    // 소비자 상태
+    PlayerInput cur;      // 마지막으로 반영한 입력
+    stat_t folded;        // 반영한 이벤트 수
+    stat_t empty_ticks;   // 새 이벤트가 없던 틱 수
+    Histogram staleness;  // 수신부터 반영까지 걸린 시간
+    PlayerInput last_ev;  // 마지막 이벤트 값, 입력 변화 판별용
+    InputTrace trace;     // 마지막으로 반영한 입력 변화
+} InputQueue;
+
+/* input_push()
+ * 리액터 전용, 큐가 가득 차면 새 이벤트를 버린다
+ */
+int input_push(InputQueue *q, const InputEvent *e) {
+    unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    STAT_ADD(q->pushed, 1);
+    if (head - tail >= INPUT_QUEUE_SIZE) {
+        STAT_ADD(q->dropped, 1);
+        return -1;
     }
+    q->ev[head & (INPUT_QUEUE_SIZE - 1)] = *e;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return 0;
+}
 
-    // 컨트롤러 연결 완료
-    if (CTRL1_PORT == port) {
-        ctrl1_connect = 1;
-        printf("Player 1 connected\n");
-    } else {
-        ctrl2_connect = 1;
-        printf("Player 2 connected\n");
+/* input_fold()
+ * 게임 루프 전용, 지난 틱 이후의 이벤트를 하나의 입력으로 합침
+ * 이동은 가장 최근 값, 궁극기와 초음파는 한 번이라도 눌렸으면 이번 틱에 반영
+ * 새 이벤트가 없으면 이전 입력을 유지
+ */
+const PlayerInput *input_fold(InputQueue *q, uint64_t now) {
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail == head) {
+        STAT_ADD(q->empty_ticks, 1);
+        return &q->cur;
     }
 
-    char msg[5] = { 0 }; // 0000 [UP][DOWN][궁극기][초음파]
-    int str_len = 0;
-    printf("%s\n", msg);
-    while (sock_listen) {
-        str_len = read(client_fd, msg, sizeof(msg));
-        if (CTRL1_PORT == port) {
-            ctrl1_v = (msg[1] - '0') - (msg[0] - '0');
-            ctrl1_ult = msg[2] - '0';
-            ctrl1_rcv = msg[3] - '0';
-        } else {
-            ctrl2_v = (msg[1] - '0') - (msg[0] - '0');
-            ctrl2_ult = msg[2] - '0';
+    int ult = 0, rcv = 0, traced = 0; // 틱 안에서 가장 빠른 초음파 반사를 쓴다
+    for (; tail != head; tail++) {
+        const InputEvent *e = &q->ev[tail & (INPUT_QUEUE_SIZE - 1)];
+        // 틱마다 첫 입력 변화 하나를 추적, 측정 시각이 없는 기존 형식과 봇 입력은 제외
+        int changed = e->axis != q->last_ev.axis || (e->ult && !q->last_ev.ult) || (e->rcv && !q->last_ev.rcv);
+        if (changed && e->t_sent && !traced) {
+            q->trace.id++;
+            q->trace.t_origin = e->t_sent;
+            q->trace.t_recv = e->t_recv;
+            q->trace.t_applied = now;
+            traced = 1;
         }
-        usleep(INPUT_DELAY_us);
+        q->last_ev.axis = e->axis;
+        q->last_ev.ult = e->ult;
+        q->last_ev.rcv = e->rcv;
+        q->cur.axis = e->axis;
+        ult |= e->ult;
+        if (e->rcv > rcv) rcv = e->rcv;
+        hist_record(&q->staleness, now > e->t_recv ? now - e->t_recv : 0);
+        STAT_ADD(q->folded, 1);
     }
+    q->cur.ult = ult;
+    q->cur.rcv = rcv;
+    atomic_store_explicit(&q->tail, tail, memory_order_release);
+    return &q->cur;
+}
 
-    close(client_fd);
-    close(server_fd);
-    pthread_exit(NULL);
+void input_dump(InputQueue *input) {
+    for (int i = 0; i < 2; i++) {
+        InputQueue *q = &input[i];
+        printf("== input player%d ==\n", i + 1);
+        printf("pushed: %llu dropped: %llu folded: %llu empty ticks: %llu\n", (unsigned long long)STAT_GET(q->pushed),
+               (unsigned long long)STAT_GET(q->dropped),
+               (unsigned long long)STAT_GET(q->folded), (unsigned long long)STAT_GET(q->empty_ticks));
+        hist_dump("stale", &q->staleness);
+    }
 }
 
+int sock_listen; // 네트워크, 출력, 워커 스레드 종료 플래그
+
 /* init_game()
- * 게임 변수 초기화
+ * 게임 변수 초기화, seed로 경기 중 쓸 난수를 정한다
  */
-int init_game(GameState *state) {
+int init_game(GameState *state, uint64_t seed) {
     state->frame = 0;
     state->gameover = 0;
+    state->rng = seed;
 
     // 공 위치 초기화
     reset_ball(state);
@@ -275,15 +444,27 @@ int init_game(GameState *state) {
 }
 
 /* get_input()
- * 컨트롤러로부터 입력 수신
- */
-int get_input(GameState *state) {
-    state->player1.paddle_v = ctrl1_v * PADDLE_SPEED;
-    state->player1.ult_cnt += state->player1.ult_cnt ? 0 : ctrl1_ult * ULT_FRAME;
-    state->player1.paddle_reflect = PADDLE_REFLECT * (1 + ctrl1_rcv * 2);
-    state->player2.paddle_v = ctrl2_v * PADDLE_SPEED;
-    state->player2.ult_cnt += state->player2.ult_cnt ? 0 : ctrl2_ult * ULT_FRAME;
-    return 0;
+ * 플레이어별 입력 큐에서 이번 틱에 반영할 컨트롤러 입력을 모은다
+ */
+void get_input(InputQueue *input, PlayerInput in[2]) {
+    uint64_t now = now_ns();
+    in[0] = *input_fold(&input[0], now);
+    in[1] = *input_fold(&input[1], now);
+}
+
+/* apply_input()
+ * 모은 입력을 플레이어 상태에 반영, 경기 기록은 이 입력을 남긴다
+ */
+void apply_input(GameState *state, const PlayerInput in[2]) {
+    const PlayerInput *in1 = &in[0];
+    const PlayerInput *in2 = &in[1];
+    state->player1.paddle_v = in1->axis * PADDLE_SPEED / PROTO_AXIS_ONE;
+    state->player1.ult_cnt += state->player1.ult_cnt ? 0 : in1->ult * ULT_FRAME;
+    // 초음파 반사는 컨트롤러를 빨리 움직일수록 세진다
+    int rcv = in1->rcv < RCV_FULL_SPEED ? in1->rcv : RCV_FULL_SPEED;
+    state->player1.paddle_reflect = PADDLE_REFLECT + (RCV_REFLECT_MAX - PADDLE_REFLECT) * rcv / RCV_FULL_SPEED;
+    state->player2.paddle_v = in2->axis * PADDLE_SPEED / PROTO_AXIS_ONE;
+    state->player2.ult_cnt += state->player2.ult_cnt ? 0 : in2->ult * ULT_FRAME;
 }
 
 /* check_gameover()
@@ -296,18 +477,148 @@ int check_gameover(GameState *state) {
     return 0;
 }
 
-// TODO: 적절하게 함수로 분리
+/* 공 이동 (연속 충돌 판정)
+ * 한 틱 동안 공이 지나는 선분에서 벽, 패들 면, 골라인 중 가장 먼저 닿는 시각을 구해 그 시각까지 옮기고 반사한 뒤
+ * 남은 시간으로 다시 반복한다. 한 틱에 여러 번 튕겨도 패들이나 벽을 건너뛰지 않으므로 결과가 틱 길이에 좌우되지 않는다
+ * 시간은 기준 프레임(SPEED_FPS) 하나를 PHYS_ONE으로 둔 정수, 패들은 이번 틱에 옮긴 위치에 멈춰 있는 것으로 본다
+ */
+#define PHYS_ONE 65536
+#define PHYS_TICK ((int64_t)PHYS_ONE * SPEED_FPS / GAME_FPS) // 한 틱의 길이
+#define MAX_BOUNCES 8                                        // 한 틱에 처리할 최대 충돌 수
+
+enum { HIT_NONE, HIT_WALL, HIT_PADDLE1, HIT_PADDLE2, HIT_GOAL1, HIT_GOAL2 };
+
+// pos에서 속도 v로 target까지 가는 시간, 멀어지는 중이거나 limit 안에 닿지 않으면 -1
+// 대부분의 틱은 아무 데도 닿지 않으므로 나눗셈 없이 거른다
+int64_t time_to(int pos, int v, int target, int64_t limit) {
+    int64_t dist = (int64_t)(target - pos) * PHYS_ONE;
+    if (v > 0 ? dist < 0 || dist > v * limit : v < 0 ? dist > 0 || dist < v * limit : 1) return -1;
+    return dist / v;
+}
+
+// 시간 t 뒤의 좌표
+int pos_at(int pos, int v, int64_t t) {
+    return pos + (int)((int64_t)v * t / PHYS_ONE);
+}
+
+/* paddle_hit()
+ * 공이 패들 면의 x 좌표에 닿는 시간, 그때 공이 패들 길이 안에 없으면 -1
+ */
+int64_t paddle_hit(const Ball *ball, const Player *player, int face, int64_t limit) {
+    int64_t t = time_to(ball->w, ball->vw, face, limit);
+    if (t < 0) return -1;
+    int h = pos_at(ball->h, ball->vh, t);
+    return h >= player->h && h <= player->h + player->paddle_len - 1 ? t : -1;
+}
+
+/* paddle_bounce()
+ * 패들에 맞은 공 반사, boost가 있으면 반사 속도 계수가 100보다 클 때 부스트 상태가 된다
+ */
+void paddle_bounce(Ball *ball, const Player *player, int boost) {
+    ball->vw = -ball->vw;
+
+    // TODO: 패들 끝 부분에서는 반사 각도 다르게
+
+    // TODO: 패들 속도에 따라 반사 각도 달라지게
+
+    // 패들 반사속도 관련
+    if (ball->boost_cnt) {
+        ball->vh = ball->vh / 3;
+        ball->vw = ball->vw / 3;
+        ball->boost_cnt = 0;
+    }
+
+    if (boost && player->paddle_reflect > 100) {
+        ball->boost_cnt = 1;
+    }
+
+    ball->vh = ball->vh * player->paddle_reflect / 100;
+    ball->vw = ball->vw * player->paddle_reflect / 100;
+}
+
+/* move_ball()
+ * 공을 한 틱만큼 옮기며 닿는 순서대로 벽, 패들 반사와 득점 처리
+ */
+void move_ball(GameState *state) {
+    Ball *ball = &state->ball;
+    int64_t left = PHYS_TICK;
+
+    // 벽과 두 패들 면 사이에서 시작해 그 안에서 끝나면 닿을 것이 없다 (대부분의 틱)
+    int h = pos_at(ball->h, ball->vh, left), w = pos_at(ball->w, ball->vw, left);
+    int lo = state->player1.w + 1, hi = state->player2.w - 1;
+    if (0 < h && h < HEIGHT - 1 && lo < w && w < hi && lo < ball->w && ball->w < hi) {
+        ball->h = h;
+        ball->w = w;
+        return;
+    }
+    for (int i = 0; i < MAX_BOUNCES && left > 0; i++) {
+        int64_t t = left, tt;
+        int hit = HIT_NONE;
+
+        // 위아래 벽
+        tt = time_to(ball->h, ball->vh, ball->vh < 0 ? 0 : HEIGHT - 1, t);
+        if (tt >= 0) {
+            t = tt;
+            hit = HIT_WALL;
+        }
+
+        // 진행 방향의 패들 면, 놓치면 골라인
+        if (ball->vw < 0) {
+            if ((tt = paddle_hit(ball, &state->player1, state->player1.w + 1, t)) >= 0) {
+                t = tt;
+                hit = HIT_PADDLE1;
+            } else if ((tt = time_to(ball->w, ball->vw, 0, t)) >= 0) {
+                t = tt;
+                hit = HIT_GOAL1;
+            }
+        } else if (ball->vw > 0) {
+            if ((tt = paddle_hit(ball, &state->player2, state->player2.w - 1, t)) >= 0) {
+                t = tt;
+                hit = HIT_PADDLE2;
+            } else if ((tt = time_to(ball->w, ball->vw, WIDTH - 1, t)) >= 0) {
+                t = tt;
+                hit = HIT_GOAL2;
+            }
+        }
+
+        ball->h = pos_at(ball->h, ball->vh, t);
+        ball->w = pos_at(ball->w, ball->vw, t);
+        left -= t;
+
+        // 닿은 면에 정확히 맞춘 뒤 반사
+        switch (hit) {
+        case HIT_WALL:
+            ball->h = ball->vh < 0 ? 0 : HEIGHT - 1;
+            ball->vh = -ball->vh;
+            break;
+        case HIT_PADDLE1:
+            ball->w = state->player1.w + 1;
+            paddle_bounce(ball, &state->player1, 1);
+            break;
+        case HIT_PADDLE2:
+            ball->w = state->player2.w - 1;
+            paddle_bounce(ball, &state->player2, 0);
+            break;
+        case HIT_GOAL1:
+            // TODO: 먹힌 후 글로벌 딜레이 처리?
+            state->player2.score++;
+            reset_ball(state);
+            return;
+        case HIT_GOAL2:
+            state->player1.score++;
+            reset_ball(state);
+            return;
+        }
+    }
+}
+
 /* update_game()
- * 게임 프레임 업데이트
+ * 게임 프레임 업데이트, 같은 상태와 입력이면 항상 같은 결과
  */
-int update_game(GameState *state) {
+int update_game(GameState *state, const PlayerInput in[2]) {
     state->frame++;
 
-    get_input(state);
-
-    // 공 위치 업데이트
-    state->ball.h += state->ball.vh;
-    state->ball.w += state->ball.vw;
+    apply_input(state, in);
 
     // P2 궁극기 패들 길이증가
     if (state->player2.ult_cnt)
@@ -316,8 +627,8 @@ int update_game(GameState *state) {
         state->player2.paddle_len = PADDLE_LEN;
 
     // 플레이어 위치 업데이트
-    state->player1.h += state->player1.paddle_v;
-    state->player2.h += state->player2.paddle_v;
+    state->player1.h += TICK_SPEED(state->player1.paddle_v);
+    state->player2.h += TICK_SPEED(state->player2.paddle_v);
     // 벗어나지 않도록 제한
     if (state->player1.h < 0) {
         state->player1.h = 0;
@@ -330,286 +641,2237 @@ int update_game(GameState *state) {
         state->player2.h = HEIGHT - state->player2.paddle_len - 1;
     }
 
-    // 공이 벽에 부딪히면 반사
-    if (state->ball.h <= 0 || state->ball.h >= HEIGHT - 1) {
-        state->ball.h = state->ball.h <= 0 ? 0 : HEIGHT - 1;
-        state->ball.vh = -state->ball.vh;
-    }
+    // 공 이동, 벽과 패들 반사, 득점
+    move_ball(state);
 
-    // 공이 플레이어 패들에 부딪히면 반사
+    // 궁극기 프레임 카운트
+    if (state->player1.ult_cnt) state->player1.ult_cnt--;
+    if (state->player2.ult_cnt) state->player2.ult_cnt--;
 
-    // 플레이어 1 패들 충돌 판정
-    if (state->ball.w <= state->player1.w + 1) {
-        if (state->ball.h >= state->player1.h && state->ball.h <= state->player1.h + state->player1.paddle_len - 1) {
-            // 패들에 부딪히면 반사
-            state->ball.w = state->player1.w + 1;
-            state->ball.vw = -state->ball.vw;
+    check_gameover(state);
+    return 0;
+}
 
-            // TODO: 패들 끝 부분에서는 반사 각도 다르게
+/* 콘솔 출력
+ * 메모리 위의 문자 프레임버퍼에 화면을 그린 뒤 이전 화면과 달라진 칸만 모아 write() 한 번으로 출력
+ * 출력은 별도의 낮은 우선순위 쓰레드에서 CONSOLE_FPS로만 하므로 터미널이 느려도 게임과 디스플레이 전송은 영향받지 않는다
+ */
+#define CONSOLE_ROWS (3 + DISP_HEIGHT) // 상태 3줄 + 도트 매트릭스
+#define CONSOLE_COLS 128
+#define CONSOLE_OUT_SIZE (CONSOLE_ROWS * CONSOLE_COLS * 16) // 모든 칸이 바뀌었을 때의 최대 출력 크기
 
-            // TODO: 패들 속도에 따라 반사 각도 달라지게
+// 프레임버퍼 칸, 출력 가능한 ASCII 외에 아래 기호를 쓴다
+#define CELL_BALL 1   // ●
+#define CELL_PADDLE 2 // ■
 
-            // 패들 반사속도 관련
-            if (state->ball.boost_cnt) {
-                state->ball.vh = state->ball.vh / 3;
-                state->ball.vw = state->ball.vw / 3;
-                state->ball.boost_cnt = 0;
-            }
+typedef struct {
+    unsigned char cell[CONSOLE_ROWS][CONSOLE_COLS]; // 이번에 그린 화면
+    unsigned char shown[CONSOLE_ROWS][CONSOLE_COLS]; // 터미널에 출력된 화면
+    int valid;                                       // shown이 터미널 내용과 같은지
+    char out[CONSOLE_OUT_SIZE];
+} Console;
+
+void console_text(Console *con, int row, const char *fmt, ...) {
+    char line[CONSOLE_COLS + 1];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    int len = strlen(line);
+    memset(con->cell[row], ' ', CONSOLE_COLS);
+    memcpy(con->cell[row], line, len);
+}
 
-            if (state->player1.paddle_reflect > 100) {
-                state->ball.boost_cnt = 1;
-            }
+/* render_console()
+ * 콘솔 프레임버퍼에 상태와 도트 매트릭스 시뮬레이션 그리기
+ */
+void render_console(Console *con, const GameState *state) {
+    console_text(con, 0, "frame: %d sec: %d", state->frame, state->frame / GAME_FPS);
+    console_text(con, 1, "ball: [%d, %d](%d, %d) player1: [%d, %d](%d, %d)<%d> player2: [%d, %d](%d, %d)<%d>", state->ball.h,
+                 state->ball.w, translate_dot(state->ball.h), translate_dot(state->ball.w), state->player1.h, state->player1.w,
+                 translate_dot(state->player1.h), translate_dot(state->player1.w), state->player1.ult_cnt, state->player2.h,
+                 state->player2.w, translate_dot(state->player2.h), translate_dot(state->player2.w), state->player2.ult_cnt);
+    console_text(con, 2, "score: %d, %d gameover: %d", state->player1.score, state->player2.score, state->gameover);
 
-            state->ball.vh = state->ball.vh * state->player1.paddle_reflect / 100;
-            state->ball.vw = state->ball.vw * state->player1.paddle_reflect / 100;
+    // 도트 매트릭스 시뮬레이션
+    for (int i = 0; i < DISP_HEIGHT; i++) {
+        unsigned char *row = con->cell[3 + i];
+        memset(row, ' ', CONSOLE_COLS);
+        row[0] = row[DISP_WIDTH + 1] = '|';
+    }
+    const Player *players[2] = { &state->player1, &state->player2 };
+    for (int p = 0; p < 2; p++) {
+        int h = translate_dot(players[p]->h), w = translate_dot(players[p]->w);
+        for (int i = h; i < h + translate_dot(players[p]->paddle_len) && i < DISP_HEIGHT; i++)
+            if (i >= 0 && 0 <= w && w < DISP_WIDTH) con->cell[3 + i][1 + w] = CELL_PADDLE;
+    }
+    int bh = translate_dot(state->ball.h), bw = translate_dot(state->ball.w);
+    if (state->player1.ult_cnt == 0 && 0 <= bh && bh < DISP_HEIGHT && 0 <= bw && bw < DISP_WIDTH) con->cell[3 + bh][1 + bw] = CELL_BALL;
+}
+
+/* flush_console()
+ * 달라진 칸만 커서 이동과 함께 모아 한 번에 출력
+ * 첫 출력이거나 터미널 내용을 알 수 없으면 화면을 지우고 전부 다시 그린다
+ * 반환값: 출력한 바이트 수
+ */
+int flush_console(Console *con) {
+    char *p = con->out;
+    if (!con->valid) {
+        p += sprintf(p, "\033[H\033[J");
+        memset(con->shown, ' ', sizeof(con->shown));
+        con->valid = 1;
+    }
+
+    for (int i = 0; i < CONSOLE_ROWS; i++) {
+        int cursor = -1; // 커서가 이미 놓인 열, 이어지는 칸은 커서 이동 생략
+        for (int j = 0; j < CONSOLE_COLS; j++) {
+            unsigned char c = con->cell[i][j];
+            if (c == con->shown[i][j]) continue;
+            if (cursor != j) p += sprintf(p, "\033[%d;%dH", i + 1, j + 1);
+            if (c == CELL_BALL)
+                p += sprintf(p, "●");
+            else if (c == CELL_PADDLE)
+                p += sprintf(p, "■");
+            else
+                *p++ = c;
+            con->shown[i][j] = c;
+            cursor = j + 1;
+        }
+    }
+    if (p == con->out) return 0;
+    p += sprintf(p, "\033[%d;1H", CONSOLE_ROWS + 1); // 다른 로그가 화면 아래에 찍히도록
+
+    fflush(stdout);
+    int len = p - con->out;
+    for (int off = 0; off < len;) {
+        ssize_t n = write(STDOUT_FILENO, con->out + off, len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            con->valid = 0; // 일부만 출력됐을 수 있으니 다음에 전부 다시 그린다
+            break;
         }
+        off += n;
     }
+    return len;
+}
+
+/* 게임 루프 -> 디스플레이 상태 전달
+ * 게임 루프가 틱 경계에서 seqlock으로 GameState 전체를 게시하고 eventfd로 알린다
+ * 읽는 쪽은 seq가 짝수이고 복사 전후로 같을 때만 사용하므로 한 틱의 값만 보게 된다
+ */
+typedef struct {
+    atomic_uint seq; // 홀수면 쓰는 중
+    GameState state;
+    InputTrace trace[2]; // 플레이어별 마지막으로 반영한 입력 변화
+} StateSnapshot;
 
-    // 플레이어 2 패들 충돌 판정
-    if (state->ball.w >= state->player2.w - 1) {
-        if (state->ball.h >= state->player2.h && state->ball.h <= state->player2.h + state->player2.paddle_len - 1) {
-            // 패들에 부딪히면 반사
-            state->ball.w = state->player2.w - 1;
-            state->ball.vw = -state->ball.vw;
+int publish_fd = -1; // 게시 알림용 eventfd, 모든 방이 공유
 
-            // TODO: 패들 끝 부분에서는 반사 각도 다르게
+/* publish_state()
+ * 게임 루프 전용, 현재 상태와 입력 추적 게시
+ */
+void publish_state(StateSnapshot *snap, const GameState *state, const InputQueue *input) {
+    unsigned seq = atomic_load_explicit(&snap->seq, memory_order_relaxed);
+    atomic_store_explicit(&snap->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&snap->state, state, sizeof(GameState));
+    snap->trace[0] = input[0].trace;
+    snap->trace[1] = input[1].trace;
+    atomic_store_explicit(&snap->seq, seq + 2, memory_order_release);
+}
 
-            // TODO: 패들 속도에 따라 반사 각도 달라지게
+/* read_state()
+ * 게시된 상태를 찢어지지 않게 복사, trace가 NULL이 아니면 입력 추적도 복사
+ * 반환값: 복사한 상태의 seq
+ */
+unsigned read_state(StateSnapshot *snap, GameState *out, InputTrace *trace) {
+    unsigned before, after;
+    do {
+        before = atomic_load_explicit(&snap->seq, memory_order_acquire);
+        memcpy(out, &snap->state, sizeof(GameState));
+        if (trace) memcpy(trace, snap->trace, sizeof(snap->trace));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&snap->seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return after;
+}
 
-            // 패들 반사속도 관련
-            if (state->ball.boost_cnt) {
-                state->ball.vh = state->ball.vh / 3;
-                state->ball.vw = state->ball.vw / 3;
-                state->ball.boost_cnt = 0;
-            }
+/* 경기 기록
+ * 틱마다 get_input이 모은 두 플레이어 입력을 파일에 이어 쓴다
+ * reset_ball의 난수는 모두 init_game 시드 하나에서 나오므로 시드는 헤더에 한 번만 남긴다
+ * 같은 시드와 입력으로 update_game을 다시 돌리면 같은 경기가 그대로 재현된다
+ *
+ * 파일은 RecHeader 뒤에 레코드가 이어지고, 경기가 끝나면 체크포인트 색인이 붙는다
+ * - 틱: 플래그 1바이트 + 플레이어마다 바뀐 막대 방향의 차이 (zigzag varint), 초음파 반사 속도 (varint)
+ *   입력이 그대로이고 반사가 없는 틱은 1바이트
+ * - 체크포인트: REC_CHECKPOINT + GameState 필드 varint, REC_CHECKPOINT_FRAMES마다 그 틱 앞에 두고 경기 끝에도 하나 둔다
+ *   체크포인트 다음 틱은 입력 0을 기준으로 차이를 쓰므로 체크포인트부터 바로 읽을 수 있다
+ * - 끝: REC_END + 체크포인트 개수와 (프레임, 위치) 차이 varint
+ * 헤더의 index_off는 경기가 끝날 때 채우고, 0이면 (서버가 중간에 죽은 파일) 레코드를 훑어 색인을 다시 만든다
+ * 재생은 파일을 mmap으로 읽는다
+ */
+#define REC_VERSION 3 // 물리 판정이 바뀌면 올린다, 다른 버전의 기록은 재현되지 않는다
+#define REC_CHECKPOINT_FRAMES (GAME_FPS * 5)
+#define REC_MAX_CHECKPOINTS (MAX_GAME_FRAME / REC_CHECKPOINT_FRAMES + 2) // 시작, 주기, 끝
+#define REC_STATE_FIELDS 21 // rng를 뺀 GameState의 int 필드 수
+#define REC_CHECKPOINT 0x80
+#define REC_END 0x81
 
-            state->ball.vh = state->ball.vh * state->player2.paddle_reflect / 100;
-            state->ball.vw = state->ball.vw * state->player2.paddle_reflect / 100;
-        }
-    }
+// 틱 레코드 플래그, p는 0 (플레이어1), 1 (플레이어2)
+#define REC_AXIS(p) (0x01 << (p))
+#define REC_ULT(p) (0x04 << 2 * (p))
+#define REC_RCV(p) (0x08 << 2 * (p))
 
-    // 공이 좌우 벽에 부딪히면 점수 갱신 후 공 리셋
-    // TODO: 먹힌 후 글로벌 딜레이 처리?
-    if (state->ball.w <= 0) {
-        state->player2.score++;
-        reset_ball(state);
-    } else if (state->ball.w >= WIDTH - 1) {
-        state->player1.score++;
-        reset_ball(state);
-    }
+enum { REC_TICK, REC_CP, REC_FIN };
 
-    // 궁극기 프레임 카운트
-    if (state->player1.ult_cnt) state->player1.ult_cnt--;
-    if (state->player2.ult_cnt) state->player2.ult_cnt--;
+typedef struct {
+    char magic[8];             // "PONGREC" + REC_VERSION
+    uint32_t game_fps;         // 기록한 서버의 GAME_FPS, SCALE, MAX_GAME_FRAME (다르면 재생할 수 없다)
+    uint32_t scale;
+    uint32_t max_frame;
+    uint32_t checkpoint_every; // REC_CHECKPOINT_FRAMES
+    uint64_t seed;             // init_game 시드
+    uint64_t index_off;        // REC_END 위치, 0이면 끝나지 않은 기록
+} RecHeader;
 
-    check_gameover(state);
-    return 0;
+typedef struct {
+    int frame;
+    uint64_t off; // REC_CHECKPOINT 위치
+} RecCheckpoint;
+
+// 워커 전용
+typedef struct {
+    FILE *f;
+    char path[256];
+    uint64_t off;        // 다음 레코드 위치
+    PlayerInput last[2]; // 마지막으로 기록한 입력, 차이 계산용
+    RecCheckpoint index[REC_MAX_CHECKPOINTS];
+    int count;
+} Recorder;
+
+typedef struct {
+    const uint8_t *base; // mmap한 파일
+    size_t size;
+    size_t end;          // 레코드 끝
+    RecHeader hdr;
+    size_t pos;          // 다음 레코드 위치
+    PlayerInput last[2];
+    RecCheckpoint *index;
+    int count;
+    int start_frame;          // 재생을 시작할 프레임
+    unsigned long checked;    // 재현 상태와 비교한 체크포인트 수
+    unsigned long diverged;   // 기록과 달랐던 체크포인트 수
+} Replay;
+
+void rec_header(RecHeader *h, uint64_t seed) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, "PONGREC", 7);
+    h->magic[7] = REC_VERSION;
+    h->game_fps = GAME_FPS;
+    h->scale = SCALE;
+    h->max_frame = MAX_GAME_FRAME;
+    h->checkpoint_every = REC_CHECKPOINT_FRAMES;
+    h->seed = seed;
 }
 
-/* render_console()
- * 콘솔 출력
- */
-int render_console(GameState *state) {
-    printf("\033[H\033[J"); // 화면 클리어
-    printf("frame: %d", state->frame);
-    printf(" sec: %d\n", state->frame / GAME_FPS);
-    printf("ball: [%d, %d](%d, %d)", state->ball.h, state->ball.w, translate_dot(state->ball.h), translate_dot(state->ball.w));
-    printf(" player1: [%d, %d](%d, %d)<%d>", state->player1.h, state->player1.w, translate_dot(state->player1.h), translate_dot(state->player1.w), state->player1.ult_cnt);
-    printf(" player2: [%d, %d](%d, %d)<%d>\n", state->player2.h, state->player2.w, translate_dot(state->player2.h), translate_dot(state->player2.w), state->player2.ult_cnt);
-    printf("score: %d, %d", state->player1.score, state->player2.score);
-    printf(" gameover: %d\n", state->gameover);
+int rec_put_varint(uint8_t *p, uint64_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
 
-    // 도트 매트릭스 시뮬레이션
-    for (int i = 0; i < DISP_HEIGHT; i++) {
-        printf("|");
-        for (int j = 0; j < DISP_WIDTH; j++) {
-            if (translate_dot(state->ball.h) == i && translate_dot(state->ball.w) == j && state->player1.ult_cnt == 0) {
-                printf("●");
-            } else if (translate_dot(state->player1.h) <= i && i < translate_dot(state->player1.h) + translate_dot(state->player1.paddle_len) && translate_dot(state->player1.w) == j) {
-                printf("■");
-            } else if (translate_dot(state->player2.h) <= i && i < translate_dot(state->player2.h) + translate_dot(state->player2.paddle_len) && translate_dot(state->player2.w) == j) {
-                printf("■");
-            } else {
-                printf(" ");
-            }
-        }
-        printf("|\n");
+// 반환값: 읽은 바이트 수, 잘렸으면 0
+int rec_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+    *v = 0;
+    for (int n = 0; n < 10 && p + n < end; n++) {
+        *v |= (uint64_t)(p[n] & 0x7F) << (7 * n);
+        if (!(p[n] & 0x80)) return n + 1;
     }
     return 0;
 }
 
-int disp_connect = 0;
+// 음수도 작은 값이 짧게 나오도록 부호를 최하위 비트로
+uint64_t rec_zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+int64_t rec_unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// 체크포인트에 남기는 GameState 필드 (rng 제외)
+void rec_state_fields(GameState *s, int *f[REC_STATE_FIELDS]) {
+    Player *players[2] = { &s->player1, &s->player2 };
+    int n = 0;
+    f[n++] = &s->frame;
+    f[n++] = &s->gameover;
+    f[n++] = &s->ball.h;
+    f[n++] = &s->ball.w;
+    f[n++] = &s->ball.vh;
+    f[n++] = &s->ball.vw;
+    f[n++] = &s->ball.boost_cnt;
+    for (int p = 0; p < 2; p++) {
+        f[n++] = &players[p]->h;
+        f[n++] = &players[p]->w;
+        f[n++] = &players[p]->paddle_len;
+        f[n++] = &players[p]->paddle_v;
+        f[n++] = &players[p]->paddle_reflect;
+        f[n++] = &players[p]->ult_cnt;
+        f[n++] = &players[p]->score;
+    }
+}
+
+int rec_state_equal(GameState *a, GameState *b) {
+    int *fa[REC_STATE_FIELDS], *fb[REC_STATE_FIELDS];
+    rec_state_fields(a, fa);
+    rec_state_fields(b, fb);
+    for (int i = 0; i < REC_STATE_FIELDS; i++)
+        if (*fa[i] != *fb[i]) return 0;
+    return a->rng == b->rng;
+}
 
-/* handle_disp()
- * 도트 매트릭스 연결 및 게임 화면 처리 쓰레드
- * 게임 로직 딜레이와 독립적
+/* rec_parse()
+ * 레코드 하나 해석, 틱이면 last에 입력을 풀고 체크포인트면 state에 상태를 푼다 (state는 NULL 가능)
+ * 반환값: 레코드 길이, 잘렸거나 잘못됐으면 0
  */
-void *handle_disp(void *arg) {
-    GameState *state = (GameState *)arg;
-    char msg[9] = {
-        0,
-    };
-    int server_fd;
-    struct sockaddr_in server_address;
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(DISP_PORT);
-    server_address.sin_addr.s_addr = INADDR_ANY;
+int rec_parse(const uint8_t *p, const uint8_t *end, int *type, PlayerInput last[2], GameState *state) {
+    const uint8_t *q = p + 1;
+    uint64_t v;
+    int n;
+    if (p >= end) return 0;
+    if (*p == REC_END) {
+        *type = REC_FIN;
+        return 1;
+    }
+    if (*p == REC_CHECKPOINT) {
+        GameState tmp;
+        int *f[REC_STATE_FIELDS];
+        if (!state) state = &tmp;
+        rec_state_fields(state, f);
+        for (int i = 0; i < REC_STATE_FIELDS; i++) {
+            if (!(n = rec_get_varint(q, end, &v))) return 0;
+            *f[i] = (int)rec_unzigzag(v);
+            q += n;
+        }
+        if (!(n = rec_get_varint(q, end, &state->rng))) return 0;
+        q += n;
+        memset(last, 0, 2 * sizeof(PlayerInput));
+        *type = REC_CP;
+        return q - p;
+    }
+    if (*p & ~0x3F) return 0;
+    for (int i = 0; i < 2; i++) {
+        if (*p & REC_AXIS(i)) {
+            if (!(n = rec_get_varint(q, end, &v))) return 0;
+            last[i].axis += (int)rec_unzigzag(v);
+            q += n;
+        }
+        last[i].ult = !!(*p & REC_ULT(i));
+        last[i].rcv = 0;
+        if (*p & REC_RCV(i)) {
+            if (!(n = rec_get_varint(q, end, &v))) return 0;
+            last[i].rcv = (int)v;
+            q += n;
+        }
+    }
+    *type = REC_TICK;
+    return q - p;
+}
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+void rec_write(Recorder *rec, const uint8_t *buf, int len) {
+    if (fwrite(buf, 1, len, rec->f) != (size_t)len) {
+        fprintf(stderr, "Recording %s failed, stopped\n", rec->path);
+        fclose(rec->f);
+        rec->f = NULL;
+        return;
+    }
+    rec->off += len;
+}
 
-    int option = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+/* rec_checkpoint()
+ * 현재 상태를 체크포인트로 남기고 색인에 추가
+ * 체크포인트까지는 디스크로 내보내므로 서버가 죽어도 마지막 체크포인트까지는 남는다
+ */
+void rec_checkpoint(Recorder *rec, GameState *state) {
+    uint8_t buf[1 + (REC_STATE_FIELDS + 1) * 10];
+    int *f[REC_STATE_FIELDS], len = 0;
+    buf[len++] = REC_CHECKPOINT;
+    rec_state_fields(state, f);
+    for (int i = 0; i < REC_STATE_FIELDS; i++)
+        len += rec_put_varint(buf + len, rec_zigzag(*f[i]));
+    len += rec_put_varint(buf + len, state->rng);
+    if (rec->count < REC_MAX_CHECKPOINTS) {
+        rec->index[rec->count].frame = state->frame;
+        rec->index[rec->count++].off = rec->off;
+    }
+    memset(rec->last, 0, sizeof(rec->last));
+    rec_write(rec, buf, len);
+    if (rec->f) fflush(rec->f);
+}
 
-    if (server_fd < 0) {
-        perror("Error opening socket for display");
-        pthread_exit(NULL);
+/* rec_open()
+ * 기록 파일을 만들고 헤더와 첫 체크포인트를 쓴다, 실패하면 기록하지 않고 진행
+ */
+int rec_open(Recorder *rec, const char *path, GameState *state, uint64_t seed) {
+    memset(rec, 0, sizeof(*rec));
+    snprintf(rec->path, sizeof(rec->path), "%s", path);
+    rec->f = fopen(path, "wb");
+    if (!rec->f) {
+        perror("Error opening match record");
+        return -1;
     }
+    RecHeader h;
+    rec_header(&h, seed);
+    rec_write(rec, (const uint8_t *)&h, sizeof(h));
+    if (rec->f) rec_checkpoint(rec, state);
+    return rec->f ? 0 : -1;
+}
 
-    if (bind(server_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
-        perror("Error binding socket for display");
-        close(server_fd);
-        pthread_exit(NULL);
+/* rec_tick()
+ * update_game에 넣기 직전의 입력 기록, 체크포인트 주기면 상태를 먼저 남긴다
+ */
+void rec_tick(Recorder *rec, GameState *state, const PlayerInput in[2]) {
+    if (!rec->f) return;
+    if (state->frame && state->frame % REC_CHECKPOINT_FRAMES == 0) rec_checkpoint(rec, state);
+    if (!rec->f) return;
+
+    uint8_t buf[1 + 4 * 10];
+    int len = 1;
+    buf[0] = 0;
+    for (int i = 0; i < 2; i++) {
+        if (in[i].axis != rec->last[i].axis) {
+            buf[0] |= REC_AXIS(i);
+            len += rec_put_varint(buf + len, rec_zigzag((int64_t)in[i].axis - rec->last[i].axis));
+        }
+        if (in[i].ult) buf[0] |= REC_ULT(i);
+        if (in[i].rcv) {
+            buf[0] |= REC_RCV(i);
+            len += rec_put_varint(buf + len, in[i].rcv);
+        }
     }
+    rec->last[0] = in[0];
+    rec->last[1] = in[1];
+    rec_write(rec, buf, len);
+}
 
-    listen(server_fd, 5);
+/* rec_close()
+ * 마지막 상태와 체크포인트 색인을 쓰고 헤더에 색인 위치를 채운다
+ */
+void rec_close(Recorder *rec, GameState *state) {
+    if (!rec->f) return;
+    rec_checkpoint(rec, state);
+    if (!rec->f) return;
+
+    uint64_t index_off = rec->off;
+    uint8_t buf[1 + 10 + REC_MAX_CHECKPOINTS * 20];
+    int len = 0;
+    buf[len++] = REC_END;
+    len += rec_put_varint(buf + len, rec->count);
+    for (int i = 0; i < rec->count; i++) {
+        len += rec_put_varint(buf + len, rec->index[i].frame - (i ? rec->index[i - 1].frame : 0));
+        len += rec_put_varint(buf + len, rec->index[i].off - (i ? rec->index[i - 1].off : 0));
+    }
+    rec_write(rec, buf, len);
+    if (!rec->f) return;
+
+    fseek(rec->f, offsetof(RecHeader, index_off), SEEK_SET);
+    fwrite(&index_off, sizeof(index_off), 1, rec->f);
+    if (fclose(rec->f) != 0) perror("Error closing match record");
+    rec->f = NULL;
+    printf("recorded %s: %d frames, %llu bytes\n", rec->path, state->frame, (unsigned long long)rec->off);
+}
 
-    // 디스플레이 연결 대기
-    int client_fd;
-    struct sockaddr_in client_address;
-    socklen_t client_address_size = sizeof(client_address);
-    client_fd = accept(server_fd, (struct sockaddr *)&client_address, &client_address_size);
-    if (client_fd < 0) {
-        perror("Error accepting display connection");
-        close(server_fd);
-        pthread_exit(NULL);
+/* replay_index()
+ * 파일 끝의 색인을 읽는다, 없으면 레코드를 처음부터 훑어 체크포인트를 찾는다
+ */
+int replay_index(Replay *rp) {
+    const uint8_t *end = rp->base + rp->size;
+    rp->index = malloc(sizeof(RecCheckpoint) * REC_MAX_CHECKPOINTS);
+    if (!rp->index) return -1;
+    rp->count = 0;
+
+    uint64_t off = rp->hdr.index_off;
+    if (off > sizeof(RecHeader) && off < rp->size && rp->base[off] == REC_END) {
+        const uint8_t *p = rp->base + off + 1;
+        uint64_t count, v;
+        int n, frame = 0;
+        uint64_t pos = 0;
+        if (!(n = rec_get_varint(p, end, &count)) || count > REC_MAX_CHECKPOINTS) return -1;
+        p += n;
+        for (uint64_t i = 0; i < count; i++) {
+            if (!(n = rec_get_varint(p, end, &v))) return -1;
+            frame += (int)v;
+            p += n;
+            if (!(n = rec_get_varint(p, end, &v))) return -1;
+            pos += v;
+            p += n;
+            rp->index[rp->count].frame = frame;
+            rp->index[rp->count++].off = pos;
+        }
+        rp->end = off;
+        return 0;
     }
 
-    // 디스플레이 연결 완료
-    disp_connect = 1;
-    printf("Display connected\n");
+    // 끝나지 않은 기록, 마지막 온전한 레코드까지만 쓴다
+    PlayerInput last[2] = { { 0 } };
+    GameState cp;
+    size_t pos = sizeof(RecHeader);
+    int type, n;
+    while ((n = rec_parse(rp->base + pos, end, &type, last, &cp)) > 0 && type != REC_FIN) {
+        if (type == REC_CP && rp->count < REC_MAX_CHECKPOINTS) {
+            rp->index[rp->count].frame = cp.frame;
+            rp->index[rp->count++].off = pos;
+        }
+        pos += n;
+    }
+    rp->end = pos;
+    fprintf(stderr, "Replay: unfinished record, %d checkpoints recovered\n", rp->count);
+    return 0;
+}
 
-    // 디스플레이 출력
-    while (sock_listen) {
-        if (DISPLAY_CONSOLE && ctrl1_connect && ctrl2_connect) render_console(state);
-        // 도트 매트릭스 출력 [Ball.h][Ball.x][Player1.h][Player1.x][Player1.padd_len][Player2.h][Player2.x][Player2.padd_len]
-        if (state->player1.ult_cnt)
-            msg[0] = 99; // 공 안보이도록
-        else
-            msg[0] = translate_dot(state->ball.h);
-        msg[1] = translate_dot(state->ball.w);
-        msg[2] = translate_dot(state->player1.h);
-        msg[3] = translate_dot(state->player1.w);
-        msg[4] = translate_dot(state->player1.paddle_len);
-        msg[5] = translate_dot(state->player2.h);
-        msg[6] = translate_dot(state->player2.w);
-        msg[7] = translate_dot(state->player2.paddle_len);
-        write(client_fd, msg, sizeof(msg));
-        lcd_clear();
-        lcdLoc(LINE1);
-        char p1[12] = "PLAYER1: ";
-        p1[9] = state->player1.score + '0';
-        typeln(p1);
-        lcdLoc(LINE2);
-        char p2[12] = "PLAYER2: ";
-        p2[9] = state->player2.score + '0';
-        typeln(p2);
-        usleep(DISP_FRAME_TIME_us);
-    }
-
-    // 게임 결과 출력
-    if (DISPLAY_CONSOLE) render_console(state);
-    lcd_clear();
-    lcdLoc(LINE1);
-    if (state->player1.score > state->player2.score)
-        typeln("PLAYER1 WIN!");
-    else if (state->player1.score < state->player2.score)
-        typeln("PLAYER2 WIN!");
-    else
-        typeln("!!DRAW!!");
-    usleep(1000000 * 5); // 5초 대기
+/* replay_open()
+ * 기록 파일을 mmap으로 열고 이 서버와 같은 설정으로 기록됐는지 확인
+ */
+int replay_open(Replay *rp, const char *path) {
+    memset(rp, 0, sizeof(*rp));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Error opening match record");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(RecHeader)) {
+        fprintf(stderr, "%s: not a match record\n", path);
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("Error mapping match record");
+        return -1;
+    }
+    rp->base = base;
+    rp->size = st.st_size;
+    memcpy(&rp->hdr, rp->base, sizeof(RecHeader));
+
+    RecHeader want;
+    rec_header(&want, rp->hdr.seed);
+    want.index_off = rp->hdr.index_off;
+    if (memcmp(&want, &rp->hdr, sizeof(want)) != 0) {
+        fprintf(stderr, "%s: recorded with different version or game parameters\n", path);
+        return -1;
+    }
+    if (replay_index(rp) < 0 || rp->count == 0) {
+        fprintf(stderr, "%s: broken checkpoint index\n", path);
+        return -1;
+    }
+    return 0;
+}
 
-    // 디스플레이 연결 종료
-    close(client_fd);
-    close(server_fd);
-    pthread_exit(NULL);
+/* replay_next()
+ * 다음 틱의 입력을 꺼낸다, 지나가는 체크포인트는 지금 상태와 비교해 재현이 어긋났는지 센다
+ * 반환값: 0, 기록이 끝났으면 -1
+ */
+int replay_next(Replay *rp, GameState *state, PlayerInput in[2]) {
+    const uint8_t *end = rp->base + rp->end;
+    while (1) {
+        GameState cp;
+        int type;
+        int n = rec_parse(rp->base + rp->pos, end, &type, rp->last, &cp);
+        if (n == 0 || type == REC_FIN) return -1;
+        rp->pos += n;
+        if (type == REC_TICK) {
+            in[0] = rp->last[0];
+            in[1] = rp->last[1];
+            return 0;
+        }
+        rp->checked++;
+        if (!rec_state_equal(&cp, state) && rp->diverged++ == 0) fprintf(stderr, "Replay diverged at frame %d\n", cp.frame);
+    }
 }
 
-int main(void) {
+/* replay_seek()
+ * frame 이전의 가장 가까운 체크포인트에서 상태를 풀고 frame까지 다시 진행
+ * 반환값: 0, 기록이 frame 전에 끝나면 -1 (state는 기록의 마지막 상태)
+ */
+int replay_seek(Replay *rp, int frame, GameState *state) {
+    int i = 0;
+    for (int lo = 0, hi = rp->count - 1; lo <= hi;) { // frame 이하인 마지막 체크포인트
+        int mid = (lo + hi) / 2;
+        if (rp->index[mid].frame <= frame) {
+            i = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    int type;
+    int n = rec_parse(rp->base + rp->index[i].off, rp->base + rp->end, &type, rp->last, state);
+    if (n == 0 || type != REC_CP) return -1;
+    rp->pos = rp->index[i].off + n;
+
+    PlayerInput in[2];
+    while (state->frame < frame) {
+        if (replay_next(rp, state, in) < 0) return -1;
+        update_game(state, in);
+    }
+    return 0;
+}
 
-// LCD 출력시만 사용
-#if DISABLE_LCD == 0
-    if (wiringPiSetup() == -1) exit(1);
-    // LCD init
-    lcd_fd = wiringPiI2CSetup(I2C_ADDR);
-    lcd_init();
-#endif
+void replay_close(Replay *rp) {
+    if (rp->base) munmap((void *)rp->base, rp->size);
+    free(rp->index);
+    memset(rp, 0, sizeof(*rp));
+}
 
-    GameState state;
+// 게임 루프 스케줄러
+typedef struct {
+    uint64_t start;         // 루프 시작 시각
+    uint64_t deadline;      // 다음 틱의 절대 마감 시각 (CLOCK_MONOTONIC, ns)
+    uint64_t finish;        // 마지막 스텝 종료 시각
+    stat_t ticks;           // 처리한 물리 스텝 수
+    stat_t wakeups;         // 스케줄러 기상 횟수
+    stat_t catchup_ticks;   // 지연 복구를 위해 추가로 처리한 스텝 수
+    stat_t skipped_ticks;   // 복구 한도를 넘어 버린 스텝 수
+    Histogram jitter;       // 마감 시각 대비 기상 지연
+    Histogram overrun;      // 다음 마감 시각을 넘긴 처리 시간
+    Histogram step;         // update_game 한 번의 처리 시간
+} LoopClock;
+
+/* loop_start()
+ * 게임 루프 스케줄러 초기화, 첫 틱은 즉시 실행
+ * 통계는 메트릭과 리액터 쓰레드가 읽고 있을 수 있으므로 하나씩 atomic하게 비운다
+ */
+void loop_start(LoopClock *clk) {
+    STAT_SET(clk->ticks, 0);
+    STAT_SET(clk->wakeups, 0);
+    STAT_SET(clk->catchup_ticks, 0);
+    STAT_SET(clk->skipped_ticks, 0);
+    hist_reset(&clk->jitter);
+    hist_reset(&clk->overrun);
+    hist_reset(&clk->step);
+    clk->start = clk->deadline = clk->finish = now_ns();
+}
 
-    // 쓰레드 종료 플래그 초기화
-    sock_listen = 1;
+/* sleep_until()
+ * 절대 시각까지 대기
+ * 상대 시간 sleep과 달리 처리 시간과 스케줄링 지연이 누적되지 않는다
+ */
+void sleep_until(uint64_t deadline) {
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000ULL;
+    ts.tv_nsec = deadline % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ; // 시그널로 깨어나면 다시 대기
+}
 
-    // 쓰레드 생성
-    pthread_t ctrl1_thread, ctrl2_thread, disp_thread;
-    if (!DISABLE_SOCK) {
-        int ctrl1_port = CTRL1_PORT;
-        int ctrl2_port = CTRL2_PORT;
-        if (pthread_create(&ctrl1_thread, NULL, handle_ctrl, (void *)&ctrl1_port) < 0) {
-            perror("Error creating thread for controller 1");
-            exit(1);
-        }
-        if (pthread_create(&ctrl2_thread, NULL, handle_ctrl, (void *)&ctrl2_port) < 0) {
-            perror("Error creating thread for controller 2");
-            exit(1);
+/* loop_run()
+ * 마감 시각이 지난 틱을 모두 처리, 최대 MAX_CATCHUP_STEPS 스텝까지만 따라잡는다
+ * replay가 있으면 입력 큐 대신 기록 파일의 입력으로 진행하고, 기록이 끝나면 경기를 끝낸다
+ * 반환값: 이번에 처리한 스텝 수
+ */
+int loop_run(LoopClock *clk, GameState *state, InputQueue *input, Recorder *rec, Replay *replay) {
+    int steps = 0;
+    uint64_t now = now_ns();
+    if (now < clk->deadline) return 0;
+    STAT_ADD(clk->wakeups, 1);
+    hist_record(&clk->jitter, now - clk->deadline);
+
+    while (!state->gameover && now >= clk->deadline && steps < MAX_CATCHUP_STEPS) {
+        uint64_t begin = now; // 앞 스텝의 종료 시각을 그대로 써서 시계를 더 읽지 않는다
+        PlayerInput in[2];
+        if (!replay) {
+            get_input(input, in);
+        } else if (replay_next(replay, state, in) < 0) {
+            state->gameover = 1;
+            break;
         }
+        rec_tick(rec, state, in);
+        update_game(state, in);
+        clk->deadline += FRAME_TIME_ns;
+        STAT_ADD(clk->ticks, 1);
+        if (steps++) STAT_ADD(clk->catchup_ticks, 1);
+        now = clk->finish = now_ns();
+        hist_record(&clk->step, now - begin);
+        // 처리가 다음 틱의 마감 시각을 넘긴 만큼을 기록
+        hist_record(&clk->overrun, now > clk->deadline ? now - clk->deadline : 0);
     }
-    if (!DISABLE_DISP) {
-        if (pthread_create(&disp_thread, NULL, handle_disp, (void *)&state) < 0) {
-            perror("Error creating thread for display");
-            exit(1);
-        }
+
+    // 한도 내에 따라잡지 못하면 밀린 틱은 버리고 현재 시각 기준으로 다시 맞춘다
+    if (now >= clk->deadline) {
+        uint64_t behind = (now - clk->deadline) / FRAME_TIME_ns + 1;
+        STAT_ADD(clk->skipped_ticks, behind);
+        clk->deadline += behind * FRAME_TIME_ns;
     }
 
-    int connect_cnt = 0;
-    while (!ctrl1_connect || !ctrl2_connect || !disp_connect) {
-        if (DISABLE_SOCK) ctrl1_connect = ctrl2_connect = 1;
-        if (DISABLE_DISP) disp_connect = 1;
-        printf("\033[H\033[J"); // 화면 클리어
+    return steps;
+}
 
-        if (!ctrl1_connect) {
-            printf("Waiting for controller 1");
+/* loop_dump()
+ * 경기 종료 후 스케줄러 통계 출력
+ */
+void loop_dump(LoopClock *clk) {
+    uint64_t elapsed = clk->finish - clk->start;
+    printf("== loop stats ==\n");
+    printf("ticks: %llu (target %d) wall: %.3fs wakeups: %llu catchup: %llu skipped: %llu\n",
+           (unsigned long long)STAT_GET(clk->ticks), MAX_GAME_FRAME, elapsed / 1e9, (unsigned long long)STAT_GET(clk->wakeups),
+           (unsigned long long)STAT_GET(clk->catchup_ticks), (unsigned long long)STAT_GET(clk->skipped_ticks));
+    hist_dump("jitter", &clk->jitter);
+    hist_dump("overrun", &clk->overrun);
+    hist_dump("step", &clk->step);
+}
+
+// 플레이어 한 명의 난수 입력 (벤치마크, 봇)
+void bot_input(uint64_t *rng, InputEvent *e, InputQueue *q, int player) {
+    uint64_t r = rng_next(rng);
+    if (r % 8 == 0) e->axis = ((int)((r >> 8) % 3) - 1) * PROTO_AXIS_ONE; // 가끔 방향 전환
+    e->ult = (r >> 16) % 600 == 0;
+    e->rcv = player == 1 && (r >> 32) % 60 == 0 ? RCV_FULL_SPEED : 0;
+    input_push(q, e);
+}
+
+/* LCD 점수판
+ * I2C 문자 LCD는 글자 하나에 수 ms가 걸리므로 전용 쓰레드에서만 출력한다
+ * 다른 쓰레드는 lcd_post()로 원하는 화면 내용만 넘기고, 몰려온 요청은 마지막 것 하나로 합쳐진다
+ * 출력 쓰레드는 화면에 이미 있는 글자와 비교해 바뀐 칸만 다시 쓴다 (lcd_clear 없음)
+ */
+#define LCD_LINES 2
+#define LCD_COLS 16
+#define LCD_WAKE_ms 100 // 종료 플래그 확인 주기
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char text[LCD_LINES][LCD_COLS]; // 마지막으로 요청된 화면
+    int pending;                    // 출력하지 않은 요청이 있는지
+    unsigned long posts;            // 요청 수
+    unsigned long coalesced;        // 출력 전에 다음 요청으로 덮어쓴 수
+} LcdQueue;
+
+LcdQueue lcd_queue = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// LCD 출력 쓰레드 통계
+typedef struct {
+    stat_t redraws;        // 실제로 바뀐 칸이 있었던 출력 횟수
+    stat_t cells;          // 다시 쓴 칸 수
+    stat_t bytes;          // LCD로 보낸 명령, 글자 수
+    stat_t bus_ns;         // I2C 전송에 쓴 총 시간
+    Histogram bus;         // 출력 한 번의 I2C 전송 시간
+} LcdStats;
+
+LcdStats lcd_stats;
+
+/* lcd_post()
+ * 점수판에 띄울 두 줄 요청, 블로킹 없이 바로 반환
+ */
+void lcd_post(const char *line1, const char *line2) {
+    const char *lines[LCD_LINES] = { line1, line2 };
+    pthread_mutex_lock(&lcd_queue.lock);
+    if (lcd_queue.pending) lcd_queue.coalesced++;
+    for (int i = 0; i < LCD_LINES; i++) {
+        int len = strnlen(lines[i], LCD_COLS);
+        memset(lcd_queue.text[i], ' ', LCD_COLS);
+        memcpy(lcd_queue.text[i], lines[i], len);
+    }
+    lcd_queue.pending = 1;
+    lcd_queue.posts++;
+    pthread_cond_signal(&lcd_queue.cond);
+    pthread_mutex_unlock(&lcd_queue.lock);
+}
+
+void lcd_send(int bits, int mode) {
 #if DISABLE_LCD == 0
-            lcdLoc(LINE1);
-            typeln("WAIT CTRL1");
+    lcd_byte(bits, mode);
+#else
+    (void)bits;
+    (void)mode;
 #endif
-            for (int i = 0; i < connect_cnt % 6; i++) {
-                printf(".");
-            }
+    STAT_ADD(lcd_stats.bytes, 1);
+}
+
+/* lcd_draw()
+ * 화면에 있는 글자(shown)와 다른 칸만 출력
+ * 연속해서 바뀐 칸은 LCD 커서 자동 증가를 이용해 위치 지정을 한 번만 한다
+ */
+void lcd_draw(char shown[LCD_LINES][LCD_COLS], char text[LCD_LINES][LCD_COLS]) {
+    static const int line_addr[LCD_LINES] = { 0x80, 0xC0 }; // LINE1, LINE2
+    uint64_t start = now_ns();
+    unsigned long cells = 0;
+
+    for (int i = 0; i < LCD_LINES; i++) {
+        int cursor = -1;
+        for (int j = 0; j < LCD_COLS; j++) {
+            if (text[i][j] == shown[i][j]) continue;
+            if (cursor != j) lcd_send(line_addr[i] + j, 0); // LCD_CMD
+            lcd_send(text[i][j], 1);                        // LCD_CHR
+            shown[i][j] = text[i][j];
+            cursor = j + 1;
+            cells++;
+        }
+    }
+    if (!cells) return;
+
+    uint64_t elapsed = now_ns() - start;
+    STAT_ADD(lcd_stats.redraws, 1);
+    STAT_ADD(lcd_stats.cells, cells);
+    STAT_ADD(lcd_stats.bus_ns, elapsed);
+    hist_record(&lcd_stats.bus, elapsed);
+}
+
+/* handle_lcd()
+ * LCD 출력 쓰레드, 요청이 올 때만 깨어나 가장 최근 화면을 그린다
+ */
+void *handle_lcd(void *arg) {
+    (void)arg;
+    char shown[LCD_LINES][LCD_COLS]; // lcd_init이 화면을 지운 상태에서 시작
+    char text[LCD_LINES][LCD_COLS];
+    memset(shown, ' ', sizeof(shown));
+
+    while (sock_listen) {
+        pthread_mutex_lock(&lcd_queue.lock);
+        if (!lcd_queue.pending) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += LCD_WAKE_ms * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&lcd_queue.cond, &lcd_queue.lock, &ts);
+        }
+        int pending = lcd_queue.pending;
+        if (pending) memcpy(text, lcd_queue.text, sizeof(text));
+        lcd_queue.pending = 0;
+        pthread_mutex_unlock(&lcd_queue.lock);
+
+        if (pending) lcd_draw(shown, text);
+    }
+    pthread_exit(NULL);
+}
+
+/* lcd_dump()
+ * LCD 요청, 출력, I2C 사용 시간 통계 출력
+ */
+void lcd_dump(double wall_s) {
+    printf("== lcd ==\n");
+    uint64_t bus_ns = STAT_GET(lcd_stats.bus_ns);
+    pthread_mutex_lock(&lcd_queue.lock); // 요청 수는 lcd_post가 잠금 안에서 센다
+    unsigned long posts = lcd_queue.posts, coalesced = lcd_queue.coalesced;
+    pthread_mutex_unlock(&lcd_queue.lock);
+    printf("posts: %lu coalesced: %lu redraws: %llu cells: %llu bytes: %llu bus: %.1fms (%.2f%% of %.1fs)\n", posts,
+           coalesced, (unsigned long long)STAT_GET(lcd_stats.redraws), (unsigned long long)STAT_GET(lcd_stats.cells),
+           (unsigned long long)STAT_GET(lcd_stats.bytes), bus_ns / 1e6, wall_s > 0 ? bus_ns / 1e7 / wall_s : 0.0, wall_s);
+    hist_dump("bus", &lcd_stats.bus);
+}
+
+/* 경기 방
+ * 방마다 GameState, 입력 큐, 게시용 스냅샷, 디스플레이 구독자를 따로 가진다
+ * 방 i는 워커 (i % worker_count)가 전담해서 진행한다
+ */
+#define MAX_ROOMS 64                  // 최대 방 개수
+#define MAX_SUBSCRIBERS 4             // 방별 디스플레이 구독자 수
+#define ROOM_REST_s 5                 // 경기 종료 후 결과 표시 시간
+#define ROOM_POLL_ns (10 * 1000000LL) // 대기 중인 방 확인 주기
+
+enum { ROOM_WAIT, ROOM_PLAY, ROOM_OVER };
+
+// 입력 -> 화면 구간별 지연, 리액터 전용
+typedef struct {
+    Histogram uplink;   // 컨트롤러 측정 -> 서버 수신
+    Histogram queue;    // 서버 수신 -> get_input 반영
+    Histogram frame;    // 반영 -> 디스플레이 프레임 전송
+    Histogram downlink; // 프레임 전송 -> 디스플레이 수신
+    Histogram render;   // 디스플레이 수신 -> update_Matrix 완료
+    Histogram total;    // 컨트롤러 측정 -> update_Matrix 완료
+    unsigned long started;   // 게시된 입력 변화 수
+    unsigned long completed; // 출력 완료까지 확인한 수
+    unsigned long unseen;    // 화면에 나오지 않아 버린 수
+} TraceStats;
+
+struct Conn;
+
+typedef struct {
+    int id;
+    atomic_int phase; // ROOM_*
+
+    // 워커 전용
+    GameState state;
+    LoopClock clk;
+    uint64_t seed;
+    uint64_t over_at;    // 경기 종료 시각
+    uint64_t bot_rng;    // 봇 입력용 난수
+    InputEvent bot_ev[2];
+    Recorder rec;        // 경기 기록, 기록하지 않으면 rec.f가 NULL
+    Replay *replay;      // 기록 파일을 재생하는 방이면 NULL이 아님
+
+    InputQueue input[2]; // 리액터 -> 워커
+    StateSnapshot pub;   // 워커 -> 리액터, 점수판
+    atomic_int pub_pending; // 리액터가 아직 처리하지 않은 게시가 있는지
+
+    // 처리량 보고용, 워커만 쓴다
+    stat_t ticks;
+    stat_t matches;
+
+    // 0번 방 점수판, 워커 전용
+    int board_score[2]; // LCD에 요청한 점수, 새 경기면 -1
+
+    // 연결 상태, 리액터가 쓰고 워커와 메인이 읽는다
+    atomic_int ctrl_connect[2];
+    stat_t disp_count; // 리액터만 쓴다
+
+    // 리액터 전용
+    struct Conn *ctrl[2];
+    struct Conn *disp[MAX_SUBSCRIBERS];
+    int last_slot; // 마지막으로 전송한 디스플레이 구간
+    DispMotion motion; // 공 궤적이 마지막으로 바뀐 시점의 좌표와 속도
+    uint32_t trace_last[2];    // 마지막으로 가져온 입력 추적 id
+    InputTrace trace_wait[2];  // 아직 프레임으로 보내지 않은 입력 추적
+    TraceStats lat;
+    unsigned long disp_frames;  // 디스플레이로 보낸 프레임 수 (구독자마다 따로 센다)
+    unsigned long disp_bytes;   // 디스플레이로 보낸 화면 프레임 바이트 수, UDP 재전송 포함
+    unsigned long disp_motion_bytes; // PROTO_DISP_MOTION으로 보낸 바이트 수, disp_bytes와 따로 센다
+    unsigned long disp_dropped; // 송신 버퍼가 차서 버린 프레임 수
+} Room;
+
+typedef struct {
+    int id;
+    int cpu; // 고정할 코어
+    pthread_t thread;
+} Worker;
+
+Room rooms[MAX_ROOMS];
+int room_count = 1;
+int worker_count = 1;
+int serve_forever = 0; // 경기가 끝나도 방을 다시 열지 (다중 경기 모드)
+int bot_mode = 0;      // 연결 없이 난수 입력으로 진행 (부하 테스트)
+const char *record_dir; // 경기 기록 파일을 남길 디렉터리, NULL이면 기록하지 않음
+
+int room_ready(Room *r) {
+    if (bot_mode) return 1;
+    if (r->replay) return DISABLE_DISP || STAT_GET(r->disp_count) > 0; // 컨트롤러 없이 재생
+    int ctrl_ok = DISABLE_SOCK || (atomic_load(&r->ctrl_connect[0]) && atomic_load(&r->ctrl_connect[1]));
+    int disp_ok = DISABLE_DISP || STAT_GET(r->disp_count) > 0;
+    return ctrl_ok && disp_ok;
+}
+
+/* room_scoreboard()
+ * 0번 방의 점수가 바뀌었거나 경기가 끝났을 때만 LCD 점수판 갱신 요청
+ */
+void room_scoreboard(Room *r) {
+    GameState *state = &r->state;
+    if (r->id != 0) return;
+    if (state->gameover) {
+        // 게임 결과 출력
+        if (state->player1.score > state->player2.score)
+            lcd_post("PLAYER1 WIN!", "");
+        else if (state->player1.score < state->player2.score)
+            lcd_post("PLAYER2 WIN!", "");
+        else
+            lcd_post("!!DRAW!!", "");
+        return;
+    }
+    if (state->player1.score == r->board_score[0] && state->player2.score == r->board_score[1]) return;
+    r->board_score[0] = state->player1.score;
+    r->board_score[1] = state->player2.score;
+    char p1[LCD_COLS + 1], p2[LCD_COLS + 1];
+    snprintf(p1, sizeof(p1), "PLAYER1: %d", state->player1.score);
+    snprintf(p2, sizeof(p2), "PLAYER2: %d", state->player2.score);
+    lcd_post(p1, p2);
+}
+
+/* room_publish()
+ * 방 상태를 게시하고 리액터를 깨운다
+ */
+void room_publish(Room *r) {
+    room_scoreboard(r);
+    publish_state(&r->pub, &r->state, r->input);
+    atomic_store_explicit(&r->pub_pending, 1, memory_order_release);
+    uint64_t one = 1;
+    write(publish_fd, &one, sizeof(one));
+}
+
+void room_start(Room *r) {
+    r->seed = now_ns() ^ (uint64_t)time(NULL) << 32 ^ (uint64_t)r->id << 56;
+    r->bot_rng = r->seed ^ 0x5DEECE66DULL;
+    init_game(&r->state, r->seed);
+    if (r->replay) {
+        r->seed = r->replay->hdr.seed;
+        if (replay_seek(r->replay, r->replay->start_frame, &r->state) < 0) r->state.gameover = 1;
+    } else if (record_dir) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/room%d-%016llx.rec", record_dir, r->id, (unsigned long long)r->seed);
+        rec_open(&r->rec, path, &r->state, r->seed);
+    }
+    r->board_score[0] = r->board_score[1] = -1;
+    room_publish(r);
+    loop_start(&r->clk);
+    atomic_store(&r->phase, ROOM_PLAY);
+}
+
+void room_over(Room *r) {
+    r->over_at = now_ns();
+    rec_close(&r->rec, &r->state);
+    STAT_ADD(r->matches, 1);
+    atomic_store(&r->phase, ROOM_OVER);
+    if (serve_forever) {
+        printf("room %d match over: score %d:%d ticks %llu skipped %llu jitter p99 %lluus seed %llu\n", r->id,
+               r->state.player1.score, r->state.player2.score, (unsigned long long)STAT_GET(r->clk.ticks),
+               (unsigned long long)STAT_GET(r->clk.skipped_ticks), (unsigned long long)hist_percentile(&r->clk.jitter, 99),
+               (unsigned long long)r->seed);
+    }
+}
+
+/* handle_worker()
+ * 워커 쓰레드, 맡은 방들을 각자의 마감 시각에 맞춰 진행
+ * 가장 이른 마감 시각까지 잔다
+ */
+void *handle_worker(void *arg) {
+    Worker *w = (Worker *)arg;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) fprintf(stderr, "Worker %d: failed to pin to cpu %d\n", w->id, w->cpu);
+
+    while (sock_listen) {
+        uint64_t next = now_ns() + ROOM_POLL_ns;
+        for (int i = w->id; i < room_count; i += worker_count) {
+            Room *r = &rooms[i];
+            switch (atomic_load(&r->phase)) {
+            case ROOM_WAIT:
+                if (!room_ready(r)) break;
+                room_start(r);
+                /* fall through */
+            case ROOM_PLAY:
+                if (bot_mode && now_ns() >= r->clk.deadline) {
+                    bot_input(&r->bot_rng, &r->bot_ev[0], &r->input[0], 1);
+                    bot_input(&r->bot_rng, &r->bot_ev[1], &r->input[1], 2);
+                }
+                int steps = loop_run(&r->clk, &r->state, r->input, &r->rec, r->replay);
+                if (steps) {
+                    STAT_ADD(r->ticks, steps);
+                    room_publish(r);
+                }
+                if (r->state.gameover)
+                    room_over(r);
+                else if (r->clk.deadline < next)
+                    next = r->clk.deadline;
+                break;
+            case ROOM_OVER:
+                if (serve_forever && now_ns() >= r->over_at + ROOM_REST_s * 1000000000ULL) atomic_store(&r->phase, ROOM_WAIT);
+                break;
+            }
+        }
+        sleep_until(next);
+    }
+    pthread_exit(NULL);
+}
+
+/* 네트워크 리액터
+ * 리스너, 컨트롤러, 디스플레이 소켓과 게시 eventfd, timerfd를 하나의 epoll 스레드에서 처리한다
+ * 입력은 도착 즉시 읽고 디스플레이 프레임은 소켓이 쓰기 가능할 때 보낸다
+ *
+ * 기존 포트(8080, 8081, 8082)로 들어온 연결은 0번 방의 해당 역할이 되고
+ * LOBBY_PORT로 들어온 연결은 PROTO_HELLO로 방과 역할을 알려줄 때까지 대기한다
+ *
+ * UDP는 PROTO_UDP_PORT 소켓 하나로 받고, HELLO를 보낸 주소마다 fd 없는 연결을 만들어 같은 방식으로 방에 배정한다
+ * 컨트롤러 샘플은 순번으로 중복과 뒤바뀜을 걸러내고, 디스플레이에는 키프레임만 보내며
+ * 마지막 프레임을 REACTOR_TICK_ms마다 다시 보낸다
+ */
+#define MAX_CONN (8 + MAX_ROOMS * (2 + MAX_SUBSCRIBERS)) // 리스너, 클라이언트, eventfd, timerfd 포함
+#define MAX_EVENTS 64     // epoll_wait 한 번에 받을 이벤트 수
+#define CONN_BUF_SIZE 512 // 연결별 송수신 버퍼
+#define REACTOR_TICK_ms 100 // 종료 플래그 확인 주기
+
+enum { CONN_FREE, CONN_LISTEN, CONN_PENDING, CONN_CTRL, CONN_DISP, CONN_PUBLISH, CONN_TIMER, CONN_UDP, CONN_METRICS };
+
+/* 클라이언트 시계 추정
+ * 리액터가 접속 직후 PING_FAST_ms 간격으로 CLOCK_SAMPLES번, 그 뒤 PING_INTERVAL_ms마다 PROTO_PING을 보낸다
+ * 최근 CLOCK_SAMPLES개 응답 중 왕복 시간이 가장 짧은 것이 대기열 지연이 가장 적으므로 그 시계 차이를 쓴다
+ * 시각은 마이크로초 하위 32비트라서 차이는 2^32로 나눈 나머지로 계산한다
+ */
+#define CLOCK_SAMPLES 8
+#define PING_FAST_ms REACTOR_TICK_ms
+#define PING_INTERVAL_ms 2000
+#define INPUT_MAX_AGE_ms 200 // 서버 시계로 이보다 오래된 샘플은 뒤에 새 샘플이 있으면 버리고, 없으면 궁극기와 초음파를 뺀다
+
+typedef struct {
+    uint32_t offset[CLOCK_SAMPLES]; // 클라이언트 시계 - 서버 시계
+    uint32_t rtt[CLOCK_SAMPLES];
+    int count;          // 받은 응답 수
+    int valid;          // 추정값이 있는지
+    uint32_t best_offset;
+    uint32_t best_rtt;
+    uint16_t ping_seq;
+    uint64_t next_ping; // 다음 PING 시각 (ns)
+    unsigned long late; // INPUT_MAX_AGE_ms보다 늦게 도착한 샘플 수
+} ClockSync;
+
+typedef struct Conn {
+    int kind; // CONN_*
+    int fd;
+    int port;   // 리스너 포트 또는 클라이언트가 접속한 포트
+    Room *room; // 배정된 방
+    int player; // 컨트롤러 번호 (1, 2)
+    unsigned char rx[CONN_BUF_SIZE];
+    int rx_len;
+    unsigned char tx[CONN_BUF_SIZE];
+    int tx_len;
+    int want_out; // EPOLLOUT 등록 여부
+
+    // UDP 상대, fd는 공유 소켓이고 tx에는 마지막으로 보낸 데이터그램을 둔다
+    int udp;
+    struct sockaddr_in addr;
+    uint64_t last_seen;   // 마지막으로 데이터그램을 받은 시각
+    unsigned long stale;  // 순번이 늦어 버린 데이터그램 수
+
+    // 컨트롤러 프로토콜 상태
+    int has_seq;            // v2 패킷을 받은 적 있는지
+    uint16_t last_seq;      // 마지막으로 받은 순번
+    unsigned long seq_gaps; // 순번이 건너뛴 횟수
+    unsigned long bad_bytes; // 해석하지 못하고 버린 바이트 수
+    ClockSync clock;         // 시계 차이, 컨트롤러와 디스플레이 공통
+
+    // 디스플레이 프로토콜 상태
+    DispEncoder disp_enc;
+    int motion_age;           // 공 속도를 마지막으로 붙인 뒤 보낸 프레임 수
+    InputTrace trace[2];      // 보낸 프레임에 반영된 입력 추적, 출력 완료 알림을 기다린다
+    uint64_t trace_sent[2];   // 그 프레임을 보낸 시각
+    uint16_t trace_seq[2];    // 그 프레임 순번
+
+    // 통계 응답, 다 보낼 때까지 쓰기 가능 이벤트마다 이어서 보낸다
+    char *reply;
+    size_t reply_len;
+    size_t reply_sent;
+} Conn;
+
+Conn conns[MAX_CONN];
+int epoll_fd = -1;
+
+/* open_listener()
+ * 논블로킹 리스닝 소켓 생성, addr은 INADDR_ANY나 INADDR_LOOPBACK
+ */
+int open_listener(int port, in_addr_t addr) {
+    struct sockaddr_in server_address;
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    server_address.sin_addr.s_addr = htonl(addr);
+
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_fd < 0) {
+        perror("Error opening listening socket");
+        return -1;
+    }
+
+    int option = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+
+    if (bind(server_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
+        perror("Error binding listening socket");
+        close(server_fd);
+        return -1;
+    }
+
+    listen(server_fd, 16);
+    return server_fd;
+}
+
+/* open_udp()
+ * 논블로킹 UDP 소켓 생성
+ */
+int open_udp(int port) {
+    struct sockaddr_in server_address;
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    server_address.sin_addr.s_addr = INADDR_ANY;
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error opening udp socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
+        perror("Error binding udp socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* conn_alloc()
+ * 빈 연결 슬롯 할당, epoll에는 등록하지 않는다
+ */
+Conn *conn_alloc(int fd, int kind, int port) {
+    for (int i = 0; i < MAX_CONN; i++) {
+        Conn *c = &conns[i];
+        if (c->kind != CONN_FREE) continue;
+        memset(c, 0, sizeof(*c));
+        c->kind = kind;
+        c->fd = fd;
+        c->port = port;
+        return c;
+    }
+    fprintf(stderr, "Too many connections\n");
+    return NULL;
+}
+
+Conn *conn_add(int fd, int kind, int port) {
+    Conn *c = conn_alloc(fd, kind, port);
+    if (!c) return NULL;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("Error adding fd to epoll");
+        c->kind = CONN_FREE;
+        return NULL;
+    }
+    return c;
+}
+
+/* conn_detach()
+ * 연결을 방의 역할에서 해제
+ */
+void conn_detach(Conn *c) {
+    Room *r = c->room;
+    if (!r) return;
+    if (c->kind == CONN_CTRL && r->ctrl[c->player - 1] == c) {
+        r->ctrl[c->player - 1] = NULL;
+        atomic_store(&r->ctrl_connect[c->player - 1], 0);
+        // 연결이 끊긴 플레이어의 입력은 정지 상태로
+        InputEvent e = { .t_recv = now_ns() };
+        input_push(&r->input[c->player - 1], &e);
+        printf("Room %d player %d disconnected (late samples %lu)\n", r->id, c->player, c->clock.late);
+    } else if (c->kind == CONN_DISP) {
+        for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+            if (r->disp[i] != c) continue;
+            r->disp[i] = NULL;
+            STAT_SET(r->disp_count, STAT_GET(r->disp_count) - 1);
+            printf("Room %d display disconnected\n", r->id);
+        }
+    }
+    c->room = NULL;
+    c->kind = CONN_PENDING;
+}
+
+void conn_close(Conn *c) {
+    conn_detach(c);
+    free(c->reply);
+    c->reply = NULL;
+    if (!c->udp) { // UDP 상대는 소켓을 공유하므로 슬롯만 비운다
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->kind = CONN_FREE;
+}
+
+/* conn_attach()
+ * 연결을 방의 역할(PROTO_ROLE_*)에 배정
+ * 같은 방의 같은 컨트롤러 역할로 다시 접속하면 이전 연결을 대체한다
+ */
+void conn_attach(Conn *c, Room *r, int role) {
+    conn_detach(c);
+    if (role == PROTO_ROLE_DISP) {
+        int slot = -1;
+        for (int i = 0; i < MAX_SUBSCRIBERS; i++)
+            if (!r->disp[i]) slot = i;
+        if (slot < 0) {
+            fprintf(stderr, "Room %d: too many displays\n", r->id);
+            conn_close(c);
+            return;
+        }
+        r->disp[slot] = c;
+        c->kind = CONN_DISP;
+        c->room = r;
+        // 첫 프레임은 키프레임
+        memset(&c->disp_enc, 0, sizeof(c->disp_enc));
+        c->disp_enc.force_key = 1;
+        c->motion_age = DISP_KEY_INTERVAL;
+        STAT_ADD(r->disp_count, 1);
+        c->clock.next_ping = 0; // 리액터 다음 틱에 바로 시각 동기화
+        printf("Room %d display connected\n", r->id);
+    } else {
+        int player = role == PROTO_ROLE_CTRL1 ? 1 : 2;
+        if (r->ctrl[player - 1]) conn_close(r->ctrl[player - 1]);
+        r->ctrl[player - 1] = c;
+        c->kind = CONN_CTRL;
+        c->room = r;
+        c->player = player;
+        atomic_store(&r->ctrl_connect[player - 1], 1);
+        c->clock.next_ping = 0;
+        printf("Room %d player %d connected\n", r->id, player);
+    }
+}
+
+/* conn_flush()
+ * 송신 버퍼를 가능한 만큼 전송, 남으면 쓰기 가능 이벤트를 기다린다
+ */
+void conn_flush(Conn *c) {
+    if (c->udp) return;
+    while (c->tx_len > 0) {
+        ssize_t n = send(c->fd, c->tx, c->tx_len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn_close(c);
+                return;
+            }
+            break;
+        }
+        memmove(c->tx, c->tx + n, c->tx_len - n);
+        c->tx_len -= n;
+    }
+
+    int want_out = c->tx_len > 0;
+    if (want_out != c->want_out) {
+        struct epoll_event ev = { .events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.ptr = c };
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_out = want_out;
+    }
+}
+
+/* udp_send()
+ * UDP 상대에게 데이터그램 하나 전송, 다시 보낼 수 있도록 tx에 남겨둔다
+ * 소켓 버퍼가 차 있으면 그냥 버린다 (다음 재전송이나 새 프레임이 대신한다)
+ */
+void udp_send(Conn *c, const void *buf, int len) {
+    if (buf != c->tx) {
+        memcpy(c->tx, buf, len);
+        c->tx_len = len;
+    }
+    sendto(c->fd, buf, len, MSG_DONTWAIT, (struct sockaddr *)&c->addr, sizeof(c->addr));
+}
+
+/* conn_send()
+ * 송신 버퍼에 추가 후 전송 시도
+ * 상대가 못 따라와 버퍼가 차 있으면 새 프레임은 버린다
+ */
+int conn_send(Conn *c, const void *buf, int len) {
+    if (c->udp) {
+        udp_send(c, buf, len);
+        return 0;
+    }
+    if (c->tx_len + len > CONN_BUF_SIZE) return -1;
+    memcpy(c->tx + c->tx_len, buf, len);
+    c->tx_len += len;
+    conn_flush(c);
+    return 0;
+}
+
+// 서버 시계 마이크로초 하위 32비트, 클라이언트 시각과 같은 형식
+uint32_t now_us32(uint64_t ns) {
+    return (uint32_t)(ns / 1000);
+}
+
+/* clock_to_server()
+ * 클라이언트 시각을 서버 시계로 옮긴다, 동기화 전이면 같은 시계로 본다 (루프백)
+ */
+uint32_t clock_to_server(const ClockSync *clk, uint32_t t) {
+    return clk->valid ? t - clk->best_offset : t;
+}
+
+/* clock_ping()
+ * 시각 동기화 요청 전송, UDP는 재전송 버퍼를 건드리지 않도록 바로 보낸다
+ */
+void clock_ping(Conn *c, uint64_t now) {
+    uint8_t pkt[PROTO_PING_SIZE];
+    proto_put_header(pkt, PROTO_PING, PROTO_PING_SIZE, ++c->clock.ping_seq, now_us32(now));
+    if (c->udp)
+        sendto(c->fd, pkt, sizeof(pkt), MSG_DONTWAIT, (struct sockaddr *)&c->addr, sizeof(c->addr));
+    else
+        conn_send(c, pkt, sizeof(pkt));
+    c->clock.next_ping = now + (c->clock.count < CLOCK_SAMPLES ? PING_FAST_ms : PING_INTERVAL_ms) * 1000000ULL;
+}
+
+/* clock_pong()
+ * PROTO_PONG으로 왕복 시간과 시계 차이를 구해 추정값 갱신
+ */
+void clock_pong(Conn *c, const uint8_t *pkt, const ProtoHeader *h, uint64_t t_recv) {
+    ClockSync *clk = &c->clock;
+    uint32_t t1 = proto_get32(pkt + PROTO_HEADER_SIZE);
+    uint32_t t2 = proto_get32(pkt + PROTO_HEADER_SIZE + 4);
+    uint32_t t3 = h->ts_us, t4 = now_us32(t_recv);
+    int32_t rtt = (int32_t)((t4 - t1) - (t3 - t2));
+    if (rtt < 0) rtt = 0;
+    // 두 차이는 2^32를 넘나들 수 있으므로 한쪽에 작은 차이의 절반을 더한다
+    uint32_t a = t2 - t1, b = t3 - t4;
+    uint32_t offset = a + (uint32_t)((int32_t)(b - a) / 2);
+
+    int slot = clk->count++ % CLOCK_SAMPLES;
+    clk->offset[slot] = offset;
+    clk->rtt[slot] = rtt;
+    int n = clk->count < CLOCK_SAMPLES ? clk->count : CLOCK_SAMPLES, best = 0;
+    for (int i = 1; i < n; i++)
+        if (clk->rtt[i] < clk->rtt[best]) best = i;
+    int first = !clk->valid;
+    clk->best_offset = clk->offset[best];
+    clk->best_rtt = clk->rtt[best];
+    clk->valid = 1;
+    if (first || clk->count == CLOCK_SAMPLES)
+        printf("Room %d %s clock offset %+dus rtt %uus\n", c->room ? c->room->id : -1, c->kind == CONN_DISP ? "display" : c->player == 1 ? "player 1" : "player 2",
+               (int32_t)clk->best_offset, clk->best_rtt);
+}
+
+/* clock_tick()
+ * 리액터 틱마다 PING을 보낼 때가 된 클라이언트에 시각 동기화 요청
+ */
+void clock_tick(uint64_t now) {
+    for (int i = 0; i < MAX_CONN; i++) {
+        Conn *c = &conns[i];
+        if ((c->kind == CONN_CTRL || c->kind == CONN_DISP) && now >= c->clock.next_ping) clock_ping(c, now);
+    }
+}
+
+/* 통계 포트
+ * METRICS_PORT로 접속하면 그 순간의 카운터와 히스토그램을 텍스트로 한 번 보내고 끊는다
+ * 요청은 읽고 버리며 HTTP/1.0 응답으로 보내므로 curl이나 Prometheus로 바로 읽을 수 있다
+ * 워커와 LCD 쓰레드의 값은 stat_t라서 잠금 없이 읽고, 연결과 전송 상태는 리액터 자신의 것이라 그대로 읽는다
+ * 경기별 값(match_*, tick_*)은 새 경기가 시작되면 0부터 다시 센다
+ */
+#define METRICS_TIMEOUT_ms 1000 // 응답을 보낸 뒤 상대가 끊기를 기다리는 시간
+
+uint64_t server_start; // 리액터 시작 시각
+
+void metrics_hist(FILE *f, const char *name, const char *labels, Histogram *h) {
+    static const char *q[] = { "0.5", "0.9", "0.99" };
+    static const double pct[] = { 50, 90, 99 };
+    const char *sep = *labels ? "," : "";
+    for (int i = 0; i < 3; i++)
+        fprintf(f, "%s{%s%squantile=\"%s\"} %llu\n", name, labels, sep, q[i], (unsigned long long)hist_percentile(h, pct[i]));
+    fprintf(f, "%s_max{%s} %llu\n", name, labels, (unsigned long long)STAT_GET(h->max));
+    fprintf(f, "%s_sum{%s} %llu\n", name, labels, (unsigned long long)STAT_GET(h->sum));
+    fprintf(f, "%s_count{%s} %llu\n", name, labels, (unsigned long long)STAT_GET(h->count));
+}
+
+// 소켓 커널 큐에 쌓인 바이트 수 (SIOCINQ, SIOCOUTQ), 알 수 없으면 0
+int sock_queued(int fd, unsigned long req) {
+    int n = 0;
+    return ioctl(fd, req, &n) < 0 ? 0 : n;
+}
+
+/* metrics_room()
+ * 방 하나의 틱, 입력, 디스플레이 전송 통계
+ */
+void metrics_room(FILE *f, Room *r) {
+    char l[64];
+    snprintf(l, sizeof(l), "room=\"%d\"", r->id);
+    fprintf(f, "pingpong_room_phase{%s} %d\n", l, atomic_load(&r->phase));
+    fprintf(f, "pingpong_room_matches_total{%s} %llu\n", l, (unsigned long long)STAT_GET(r->matches));
+    fprintf(f, "pingpong_room_ticks_total{%s} %llu\n", l, (unsigned long long)STAT_GET(r->ticks));
+
+    LoopClock *clk = &r->clk;
+    fprintf(f, "pingpong_match_wakeups{%s} %llu\n", l, (unsigned long long)STAT_GET(clk->wakeups));
+    fprintf(f, "pingpong_match_catchup_ticks{%s} %llu\n", l, (unsigned long long)STAT_GET(clk->catchup_ticks));
+    fprintf(f, "pingpong_match_skipped_ticks{%s} %llu\n", l, (unsigned long long)STAT_GET(clk->skipped_ticks));
+    metrics_hist(f, "pingpong_tick_step_us", l, &clk->step);
+    metrics_hist(f, "pingpong_tick_overrun_us", l, &clk->overrun);
+    metrics_hist(f, "pingpong_tick_jitter_us", l, &clk->jitter);
+
+    for (int p = 0; p < 2; p++) {
+        InputQueue *q = &r->input[p];
+        char pl[80];
+        snprintf(pl, sizeof(pl), "%s,player=\"%d\"", l, p + 1);
+        unsigned depth = atomic_load_explicit(&q->head, memory_order_relaxed) - atomic_load_explicit(&q->tail, memory_order_relaxed);
+        fprintf(f, "pingpong_ctrl_connected{%s} %d\n", pl, atomic_load(&r->ctrl_connect[p]));
+        fprintf(f, "pingpong_input_pushed_total{%s} %llu\n", pl, (unsigned long long)STAT_GET(q->pushed));
+        fprintf(f, "pingpong_input_dropped_total{%s} %llu\n", pl, (unsigned long long)STAT_GET(q->dropped));
+        fprintf(f, "pingpong_input_folded_total{%s} %llu\n", pl, (unsigned long long)STAT_GET(q->folded));
+        fprintf(f, "pingpong_input_empty_ticks_total{%s} %llu\n", pl, (unsigned long long)STAT_GET(q->empty_ticks));
+        fprintf(f, "pingpong_input_queue_depth{%s} %u\n", pl, depth);
+        metrics_hist(f, "pingpong_input_stale_us", pl, &q->staleness);
+
+        Conn *c = r->ctrl[p];
+        if (!c) continue;
+        fprintf(f, "pingpong_ctrl_late_samples_total{%s} %lu\n", pl, c->clock.late);
+        fprintf(f, "pingpong_ctrl_seq_gaps_total{%s} %lu\n", pl, c->seq_gaps);
+        fprintf(f, "pingpong_ctrl_stale_total{%s} %lu\n", pl, c->stale);
+        fprintf(f, "pingpong_ctrl_bad_bytes_total{%s} %lu\n", pl, c->bad_bytes);
+        fprintf(f, "pingpong_ctrl_rtt_us{%s} %u\n", pl, c->clock.valid ? c->clock.best_rtt : 0);
+        if (!c->udp) fprintf(f, "pingpong_ctrl_socket_queue_bytes{%s} %d\n", pl, sock_queued(c->fd, SIOCINQ) + c->rx_len);
+    }
+
+    fprintf(f, "pingpong_disp_connected{%s} %llu\n", l, (unsigned long long)STAT_GET(r->disp_count));
+    fprintf(f, "pingpong_disp_frames_total{%s} %lu\n", l, r->disp_frames);
+    fprintf(f, "pingpong_disp_bytes_total{%s} %lu\n", l, r->disp_bytes);
+    fprintf(f, "pingpong_disp_motion_bytes_total{%s} %lu\n", l, r->disp_motion_bytes);
+    fprintf(f, "pingpong_disp_dropped_total{%s} %lu\n", l, r->disp_dropped);
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        Conn *c = r->disp[i];
+        if (!c || c->udp) continue;
+        // 리액터 송신 버퍼와 커널 송신 큐
+        fprintf(f, "pingpong_disp_socket_queue_bytes{%s,slot=\"%d\",queue=\"user\"} %d\n", l, i, c->tx_len);
+        fprintf(f, "pingpong_disp_socket_queue_bytes{%s,slot=\"%d\",queue=\"kernel\"} %d\n", l, i, sock_queued(c->fd, SIOCOUTQ));
+    }
+    metrics_hist(f, "pingpong_input_to_display_us", l, &r->lat.total);
+}
+
+/* metrics_report()
+ * 통계 전체를 텍스트로 만든다
+ * 반환값: malloc으로 할당한 문자열, 실패하면 NULL
+ */
+char *metrics_report(size_t *len) {
+    char *buf = NULL;
+    FILE *f = open_memstream(&buf, len);
+    if (!f) return NULL;
+
+    // 본문 길이를 미리 알 수 없으므로 HTTP/1.0으로 보내고 연결을 끊어 끝을 알린다
+    fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+    fprintf(f, "pingpong_uptime_seconds %.3f\n", (now_ns() - server_start) / 1e9);
+    fprintf(f, "pingpong_rooms %d\n", room_count);
+
+    static const char *kinds[] = { [CONN_PENDING] = "pending", [CONN_CTRL] = "ctrl", [CONN_DISP] = "disp", [CONN_METRICS] = "metrics" };
+    int clients[2][CONN_METRICS + 1] = { { 0 } };
+    int udp_fd = -1;
+    for (int i = 0; i < MAX_CONN; i++) {
+        Conn *c = &conns[i];
+        if (c->kind == CONN_UDP) udp_fd = c->fd;
+        if (c->kind <= CONN_METRICS && kinds[c->kind]) clients[c->udp][c->kind]++;
+    }
+    for (int k = 0; k <= CONN_METRICS; k++) {
+        if (!kinds[k]) continue;
+        fprintf(f, "pingpong_clients{kind=\"%s\",transport=\"tcp\"} %d\n", kinds[k], clients[0][k]);
+        if (k != CONN_METRICS) fprintf(f, "pingpong_clients{kind=\"%s\",transport=\"udp\"} %d\n", kinds[k], clients[1][k]);
+    }
+    if (udp_fd >= 0) fprintf(f, "pingpong_udp_socket_queue_bytes %d\n", sock_queued(udp_fd, SIOCINQ));
+
+    pthread_mutex_lock(&lcd_queue.lock);
+    unsigned long posts = lcd_queue.posts, coalesced = lcd_queue.coalesced;
+    pthread_mutex_unlock(&lcd_queue.lock);
+    fprintf(f, "pingpong_lcd_posts_total %lu\n", posts);
+    fprintf(f, "pingpong_lcd_coalesced_total %lu\n", coalesced);
+    fprintf(f, "pingpong_lcd_redraws_total %llu\n", (unsigned long long)STAT_GET(lcd_stats.redraws));
+    fprintf(f, "pingpong_lcd_bytes_total %llu\n", (unsigned long long)STAT_GET(lcd_stats.bytes));
+    fprintf(f, "pingpong_lcd_bus_seconds_total %.6f\n", STAT_GET(lcd_stats.bus_ns) / 1e9);
+    metrics_hist(f, "pingpong_lcd_bus_us", "", &lcd_stats.bus);
+
+    for (int i = 0; i < room_count; i++)
+        metrics_room(f, &rooms[i]);
+
+    if (fclose(f) != 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/* metrics_flush()
+ * 남은 응답을 가능한 만큼 전송, 다 보내면 쓰기 쪽을 닫고 상대가 끊기를 기다린다
+ */
+void metrics_flush(Conn *c) {
+    while (c->reply && c->reply_sent < c->reply_len) {
+        ssize_t n = send(c->fd, c->reply + c->reply_sent, c->reply_len - c->reply_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn_close(c);
+                return;
+            }
+            break;
+        }
+        c->reply_sent += n;
+    }
+
+    int want_out = c->reply && c->reply_sent < c->reply_len;
+    if (!want_out && c->reply) {
+        free(c->reply);
+        c->reply = NULL;
+        shutdown(c->fd, SHUT_WR);
+    }
+    if (want_out != c->want_out) {
+        struct epoll_event ev = { .events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.ptr = c };
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_out = want_out;
+    }
+}
+
+/* metrics_open()
+ * 통계 포트로 들어온 연결에 응답 전송 시작
+ */
+void metrics_open(int fd) {
+    Conn *c = conn_add(fd, CONN_METRICS, METRICS_PORT);
+    if (!c) {
+        close(fd);
+        return;
+    }
+    c->last_seen = now_ns();
+    c->reply = metrics_report(&c->reply_len);
+    if (!c->reply) {
+        conn_close(c);
+        return;
+    }
+    metrics_flush(c);
+}
+
+// 요청은 읽어서 버리고, 상대가 끊으면 닫는다
+void metrics_read(Conn *c) {
+    while (1) {
+        ssize_t n = read(c->fd, c->rx, CONN_BUF_SIZE);
+        if (n > 0) continue;
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) conn_close(c);
+        return;
+    }
+}
+
+/* metrics_tick()
+ * METRICS_TIMEOUT_ms 안에 끊지 않은 통계 연결 정리
+ */
+void metrics_tick(uint64_t now) {
+    for (int i = 0; i < MAX_CONN; i++) {
+        Conn *c = &conns[i];
+        if (c->kind == CONN_METRICS && now - c->last_seen > METRICS_TIMEOUT_ms * 1000000ULL) conn_close(c);
+    }
+}
+
+/* on_accept()
+ * 대기 중인 연결을 모두 받아 포트에 따라 역할 지정
+ */
+void on_accept(Conn *l) {
+    while (1) {
+        int client_fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Error accepting connection");
+            return;
+        }
+
+        if (l->port == METRICS_PORT) {
+            metrics_open(client_fd);
+            continue;
+        }
+        Conn *c = conn_add(client_fd, CONN_PENDING, l->port);
+        if (!c) {
+            close(client_fd);
+            continue;
+        }
+        if (l->port == CTRL1_PORT)
+            conn_attach(c, &rooms[0], PROTO_ROLE_CTRL1);
+        else if (l->port == CTRL2_PORT)
+            conn_attach(c, &rooms[0], PROTO_ROLE_CTRL2);
+        else if (l->port == DISP_PORT)
+            conn_attach(c, &rooms[0], PROTO_ROLE_DISP);
+    }
+}
+
+// 마이크로초 하위 32비트끼리 뺀 값 기록, 시계 추정 오차로 음수가 되면 0
+void hist_record_us32(Histogram *h, uint32_t diff) {
+    int32_t us = (int32_t)diff;
+    hist_record(h, us > 0 ? (uint64_t)us * 1000 : 0);
+}
+
+/* trace_take()
+ * 게시된 상태에서 새 입력 추적을 가져와 다음 프레임을 기다리게 한다
+ * 화면이 바뀌지 않아 TRACE_TIMEOUT_ms 동안 보내지 못했거나 더 새 입력이 오면 버린다
+ */
+void trace_take(Room *r, const InputTrace *trace, uint64_t now) {
+    for (int p = 0; p < 2; p++) {
+        InputTrace *w = &r->trace_wait[p];
+        if (trace[p].id != r->trace_last[p]) {
+            if (w->id) r->lat.unseen++;
+            r->trace_last[p] = trace[p].id;
+            *w = trace[p];
+            r->lat.started++;
+        } else if (w->id && now - w->t_applied > TRACE_TIMEOUT_ms * 1000000ULL) {
+            r->lat.unseen++;
+            w->id = 0;
+        }
+    }
+}
+
+/* trace_ship()
+ * 기다리던 입력 추적이 반영된 프레임을 디스플레이로 보냈음을 기록
+ */
+void trace_ship(Room *r, Conn *c, uint16_t seq, uint64_t now) {
+    for (int p = 0; p < 2; p++) {
+        if (!r->trace_wait[p].id) continue;
+        c->trace[p] = r->trace_wait[p];
+        c->trace_sent[p] = now;
+        c->trace_seq[p] = seq;
+    }
+}
+
+/* trace_ack()
+ * 디스플레이 출력 완료 알림 처리
+ * 추적 중인 프레임이나 그 뒤 프레임이 출력됐으면 구간별 지연을 기록
+ */
+void trace_ack(Conn *c, const uint8_t *pkt, const ProtoHeader *h) {
+    Room *r = c->room;
+    uint32_t photon = clock_to_server(&c->clock, h->ts_us);
+    uint32_t age = proto_get32(pkt + PROTO_HEADER_SIZE);
+    for (int p = 0; p < 2; p++) {
+        InputTrace *t = &c->trace[p];
+        if (!t->id || proto_seq_newer(c->trace_seq[p], h->seq)) continue;
+        TraceStats *lat = &r->lat;
+        hist_record_us32(&lat->uplink, (uint32_t)(t->t_recv / 1000) - t->t_origin);
+        hist_record(&lat->queue, t->t_applied - t->t_recv);
+        hist_record(&lat->frame, c->trace_sent[p] - t->t_applied);
+        hist_record_us32(&lat->downlink, photon - age - (uint32_t)(c->trace_sent[p] / 1000));
+        hist_record_us32(&lat->render, age);
+        hist_record_us32(&lat->total, photon - t->t_origin);
+        lat->completed++;
+        t->id = 0;
+    }
+}
+
+/* trace_dump()
+ * 경기 종료 후 입력 -> 화면 구간별 지연 출력
+ */
+void trace_dump(Room *r) {
+    TraceStats *lat = &r->lat;
+    printf("== input to display ==\n");
+    printf("traced: %lu completed: %lu unseen: %lu\n", lat->started, lat->completed, lat->unseen);
+    hist_dump("uplink", &lat->uplink);
+    hist_dump("queue", &lat->queue);
+    hist_dump("frame", &lat->frame);
+    hist_dump("downlink", &lat->downlink);
+    hist_dump("render", &lat->render);
+    hist_dump("total", &lat->total);
+}
+
+/* push_sample()
+ * 컨트롤러 샘플 하나를 입력 큐에 추가
+ */
+void push_sample(Conn *c, const ProtoSample *smp, uint16_t seq, uint32_t t_sent, uint64_t t_recv) {
+    InputEvent e;
+    e.t_recv = t_recv;
+    e.t_sent = t_sent;
+    e.seq = seq;
+    e.axis = proto_sample_axis(smp);
+    e.ult = !!(smp->buttons & PROTO_BTN_ULT);
+    e.rcv = 0;
+    if (c->player == 1 && (smp->buttons & PROTO_BTN_RCV)) // 초음파는 컨트롤러1만, 속도를 보내지 않는 컨트롤러는 최대 세기
+        e.rcv = smp->aux ? smp->aux * PROTO_AUX_SPEED_STEP : RCV_FULL_SPEED;
+    input_push(&c->room->input[c->player - 1], &e);
+}
+
+/* on_packet()
+ * v2 패킷 처리
+ * 입력은 컨트롤러로 배정된 연결에서만 받고, 묶여 온 샘플은 측정 순서대로 큐에 넣는다
+ */
+void on_packet(Conn *c, const uint8_t *pkt, const ProtoHeader *h, uint64_t t_recv) {
+    if (h->type == PROTO_HELLO) {
+        int room = pkt[PROTO_HEADER_SIZE], role = pkt[PROTO_HEADER_SIZE + 1];
+        if (room >= room_count || role < PROTO_ROLE_CTRL1 || role > PROTO_ROLE_DISP) {
+            fprintf(stderr, "Invalid hello: room %d role %d\n", room, role);
+            conn_close(c);
+            return;
+        }
+        // 이미 같은 방, 같은 역할이면 유지용 HELLO (UDP 디스플레이, 기존 포트로 접속한 클라이언트)
+        int same = c->room == &rooms[room] && (c->kind == CONN_DISP ? role == PROTO_ROLE_DISP : c->kind == CONN_CTRL && role == c->player);
+        if (!same) conn_attach(c, &rooms[room], role);
+        // UDP는 등록됐음을 알리도록 그대로 되돌려준다
+        if (c->udp && c->kind != CONN_FREE) sendto(c->fd, pkt, h->len, MSG_DONTWAIT, (struct sockaddr *)&c->addr, sizeof(c->addr));
+        return;
+    }
+    if (h->type == PROTO_PONG) {
+        clock_pong(c, pkt, h, t_recv);
+        return;
+    }
+    if (h->type == PROTO_DISP_ACK) {
+        if (c->kind == CONN_DISP) trace_ack(c, pkt, h);
+        return;
+    }
+    if (c->kind != CONN_CTRL || h->type != PROTO_INPUT) return;
+
+    int n = proto_sample_count(h);
+    int first = 0;
+    if (c->udp && c->has_seq) {
+        // 앞쪽 샘플은 이전 패킷에 실려 왔던 것, 아직 받지 못한 순번만 넣는다
+        if (!proto_seq_newer(h->seq, c->last_seq)) {
+            c->stale++;
+            return;
+        }
+        int fresh = (uint16_t)(h->seq - c->last_seq);
+        if (fresh < n) first = n - fresh;
+        else if (fresh > n) c->seq_gaps++;
+    } else if (c->has_seq && h->seq != (uint16_t)(c->last_seq + 1)) {
+        c->seq_gaps++;
+    }
+    c->has_seq = 1;
+    c->last_seq = h->seq;
+
+    uint32_t now_us = now_us32(t_recv);
+    for (int i = first; i < n; i++) {
+        ProtoSample smp;
+        proto_get_sample(pkt, i, &smp);
+        uint32_t t_sent = clock_to_server(&c->clock, h->ts_us - smp.age_us);
+        if (c->clock.valid && (int32_t)(now_us - t_sent) > INPUT_MAX_AGE_ms * 1000) {
+            c->clock.late++;
+            if (i < n - 1) continue; // 더 새 샘플이 있음
+            // 마지막 상태는 유지하되 너무 늦게 온 한 번 누름은 무시
+            smp.buttons &= ~(PROTO_BTN_ULT | PROTO_BTN_RCV);
+        }
+        push_sample(c, &smp, h->seq, t_sent, t_recv);
+    }
+}
+
+/* on_udp_read()
+ * UDP 소켓에 쌓인 데이터그램을 모두 처리
+ * 보낸 주소로 상대를 찾고, 모르는 주소는 HELLO일 때만 새 연결을 만든다
+ */
+void on_udp_read(Conn *u) {
+    uint8_t buf[CONN_BUF_SIZE];
+    while (1) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(u->fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        uint64_t t_recv = now_ns();
+
+        ProtoHeader h;
+        if (n == 0 || proto_parse(buf, n, &h) != n) {
+            u->bad_bytes += n;
+            continue;
+        }
+
+        Conn *c = NULL;
+        for (int i = 0; i < MAX_CONN && !c; i++) {
+            Conn *p = &conns[i];
+            if (p->kind != CONN_FREE && p->udp && p->addr.sin_port == from.sin_port && p->addr.sin_addr.s_addr == from.sin_addr.s_addr) c = p;
+        }
+        if (!c) {
+            if (h.type != PROTO_HELLO || !(c = conn_alloc(u->fd, CONN_PENDING, u->port))) continue;
+            c->udp = 1;
+            c->addr = from;
+        }
+        c->last_seen = t_recv;
+        on_packet(c, buf, &h, t_recv);
+    }
+}
+
+/* udp_tick()
+ * 오래 조용한 UDP 상대를 정리하고, 디스플레이에는 마지막 프레임을 다시 보낸다
+ */
+void udp_tick(void) {
+    uint64_t now = now_ns();
+    for (int i = 0; i < MAX_CONN; i++) {
+        Conn *c = &conns[i];
+        if (c->kind == CONN_FREE || !c->udp) continue;
+        if (now - c->last_seen > PROTO_UDP_TIMEOUT_ms * 1000000ULL) {
+            printf("UDP peer %s:%d timed out (stale %lu, gaps %lu)\n", inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), c->stale, c->seq_gaps);
+            conn_close(c);
+        } else if (c->kind == CONN_DISP && c->tx_len) {
+            udp_send(c, c->tx, c->tx_len);
+            int frame_len = c->tx[1]; // 화면 프레임 뒤에 붙은 공 속도는 따로 센다
+            c->room->disp_bytes += frame_len;
+            c->room->disp_motion_bytes += c->tx_len - frame_len;
+        }
+    }
+}
+
+/* on_conn_read()
+ * 소켓에 쌓인 데이터를 모두 읽고 완성된 메시지를 순서대로 처리
+ * v2 패킷과 기존 ASCII 메시지를 첫 바이트로 구분하며, 잘린 메시지는 다음 읽기까지 남겨둔다
+ */
+void on_conn_read(Conn *c) {
+    while (1) {
+        // 버퍼가 가득 차면 오래된 절반을 버린다
+        if (c->rx_len == CONN_BUF_SIZE) {
+            memmove(c->rx, c->rx + CONN_BUF_SIZE / 2, CONN_BUF_SIZE / 2);
+            c->rx_len = CONN_BUF_SIZE / 2;
+        }
+        ssize_t n = read(c->fd, c->rx + c->rx_len, CONN_BUF_SIZE - c->rx_len);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            conn_close(c);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        c->rx_len += n;
+    }
+
+    uint64_t t_recv = now_ns();
+    int i = 0;
+    while (i < c->rx_len && c->kind != CONN_FREE) {
+        const uint8_t *p = c->rx + i;
+        int left = c->rx_len - i;
+        if (proto_is_legacy(*p)) {
+            // 기존 형식 호환, 컨트롤러마다 붙는 널 문자는 아래에서 버려진다
+            if (left < PROTO_LEGACY_LEN) break;
+            if (c->kind == CONN_CTRL) {
+                ProtoSample smp;
+                proto_legacy_sample(p, &smp);
+                push_sample(c, &smp, 0, 0, t_recv);
+            }
+            i += PROTO_LEGACY_LEN;
+            continue;
+        }
+
+        ProtoHeader h;
+        int len = proto_parse(p, left, &h);
+        if (len == 0) break;
+        if (len < 0) {
+            if (*p) c->bad_bytes++;
+            i++;
+            continue;
+        }
+        on_packet(c, p, &h, t_recv);
+        i += len;
+    }
+    if (c->kind == CONN_FREE) return;
+    memmove(c->rx, c->rx + i, c->rx_len - i);
+    c->rx_len -= i;
+}
+
+/* room_send_frame()
+ * 방의 게시된 상태를 DISP_FPS로 솎아 바뀐 부분만 구독 중인 디스플레이로 전송
+ * DISP_MOTION이면 키프레임, 공 궤적이 바뀐 프레임, 숨겼던 공이 다시 나타난 프레임에만 공 좌표와 속도를 붙인다
+ * 그 사이에는 디스플레이가 마지막으로 받은 속도로 외삽하고, 공이 숨겨진 동안은 궤적이 바뀌어도 보내지 않는다
+ */
+void room_send_frame(Room *r) {
+    GameState frame;
+    GameState *state = &frame;
+    InputTrace trace[2];
+    read_state(&r->pub, state, trace);
+    if (state->gameover || DISP_SLOT(state->frame) == r->last_slot) return;
+    r->last_slot = DISP_SLOT(state->frame);
+    uint64_t now = now_ns();
+    trace_take(r, trace, now);
+    int shipped = 0;
+
+    DispFrame f;
+    f.f[DISP_FLAGS] = state->player1.ult_cnt ? DISP_FLAG_HIDE_BALL : 0;
+    f.f[DISP_BALL_H] = translate_dot(state->ball.h);
+    f.f[DISP_BALL_W] = translate_dot(state->ball.w);
+    f.f[DISP_P1_H] = translate_dot(state->player1.h);
+    f.f[DISP_P1_W] = translate_dot(state->player1.w);
+    f.f[DISP_P1_LEN] = translate_dot(state->player1.paddle_len);
+    f.f[DISP_P2_H] = translate_dot(state->player2.h);
+    f.f[DISP_P2_W] = translate_dot(state->player2.w);
+    f.f[DISP_P2_LEN] = translate_dot(state->player2.paddle_len);
+
+    DispMotion m;
+    m.tick = state->frame;
+    m.tick_us = FRAME_TIME_us;
+    m.scale = SCALE;
+    m.h = state->ball.h;
+    m.w = state->ball.w;
+    m.vh = TICK_SPEED(state->ball.vh);
+    m.vw = TICK_SPEED(state->ball.vw);
+    // 속도가 바뀌었거나 (벽, 패들, 득점 후 리셋) 마지막 궤적에서 반 도트 넘게 벗어나면 새 궤적
+    int ticks = m.tick - r->motion.tick;
+    int turned = DISP_MOTION && (m.vh != r->motion.vh || m.vw != r->motion.vw
+                                 || abs(m.h - (r->motion.h + r->motion.vh * ticks)) > SCALE / 2
+                                 || abs(m.w - (r->motion.w + r->motion.vw * ticks)) > SCALE / 2);
+    if (turned) r->motion = m;
+
+    uint32_t now_us = proto_now_us();
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        Conn *c = r->disp[i];
+        if (!c) continue;
+
+        // 도트 매트릭스 출력, 공이 숨겨진 동안은 공 좌표를 고정해 화면이 그대로면 보내지 않는다
+        DispEncoder *enc = &c->disp_enc;
+        int hidden = f.f[DISP_FLAGS] & DISP_FLAG_HIDE_BALL;
+        if (hidden) {
+            f.f[DISP_BALL_H] = enc->last.f[DISP_BALL_H];
+            f.f[DISP_BALL_W] = enc->last.f[DISP_BALL_W];
+        }
+        int motion = DISP_MOTION && !hidden
+                     && (turned || c->motion_age >= DISP_KEY_INTERVAL || (enc->last.f[DISP_FLAGS] & DISP_FLAG_HIDE_BALL));
+        // UDP 데이터그램은 각각 완결돼야 하므로 바뀔 때마다, 공 속도를 보낼 때도 키프레임
+        if (c->udp && (memcmp(&f, &enc->last, sizeof(f)) || motion)) enc->force_key = 1;
+        uint8_t pkt[PROTO_HEADER_SIZE + 2 + DISP_FIELDS + DISP_MOTION_SIZE];
+        int len = disp_encode(enc, &f, pkt, now_us);
+        // TCP 키프레임 (접속 직후, 버린 뒤, DISP_KEY_INTERVAL마다)에도 붙인다, 키프레임을 보낸 직후 since_key는 1
+        if (len && !c->udp && enc->since_key == 1) motion = DISP_MOTION && !hidden;
+        int motion_len = motion ? disp_motion_encode(&m, pkt + len, enc->seq - 1, now_us) : 0;
+        if (!len && !motion_len) continue;
+        // 보내지 못한 프레임이 있으면 다음은 키프레임으로 복구
+        if (conn_send(c, pkt, len + motion_len) < 0) {
+            enc->force_key = 1;
+            r->disp_dropped++;
+            continue;
+        }
+        c->motion_age = motion_len ? 0 : c->motion_age + (len > 0);
+        r->disp_bytes += len;
+        r->disp_motion_bytes += motion_len;
+        if (!len) continue; // 화면은 그대로이고 공 궤적만 바뀜
+        r->disp_frames++;
+        if (c->kind != CONN_FREE) trace_ship(r, c, enc->seq - 1, now);
+        shipped = 1;
+    }
+    if (shipped) r->trace_wait[0].id = r->trace_wait[1].id = 0;
+}
+
+/* on_publish()
+ * 워커가 게시한 방들을 찾아 디스플레이 프레임 전송
+ */
+void on_publish(void) {
+    uint64_t cnt;
+    read(publish_fd, &cnt, sizeof(cnt));
+    for (int i = 0; i < room_count; i++) {
+        if (atomic_exchange_explicit(&rooms[i].pub_pending, 0, memory_order_acquire)) room_send_frame(&rooms[i]);
+    }
+}
+
+/* handle_net()
+ * 네트워크 리액터 쓰레드
+ */
+void *handle_net(void *arg) {
+    (void)arg;
+    server_start = now_ns();
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("Error creating epoll");
+        exit(1);
+    }
+
+    int ports[4], port_cnt = 0;
+    if (!DISABLE_SOCK) {
+        ports[port_cnt++] = CTRL1_PORT;
+        ports[port_cnt++] = CTRL2_PORT;
+    }
+    if (!DISABLE_DISP) ports[port_cnt++] = DISP_PORT;
+    ports[port_cnt++] = LOBBY_PORT;
+    for (int i = 0; i < port_cnt; i++) {
+        int fd = open_listener(ports[i], INADDR_ANY);
+        if (fd < 0 || !conn_add(fd, CONN_LISTEN, ports[i])) exit(1);
+    }
+    // 통계 포트는 없어도 게임은 돌아가므로 실패해도 계속한다
+    int metrics_fd = open_listener(METRICS_PORT, INADDR_LOOPBACK);
+    if (metrics_fd >= 0 && !conn_add(metrics_fd, CONN_LISTEN, METRICS_PORT)) close(metrics_fd);
+    int udp_fd = open_udp(PROTO_UDP_PORT);
+    if (udp_fd < 0 || !conn_add(udp_fd, CONN_UDP, PROTO_UDP_PORT)) exit(1);
+
+    conn_add(publish_fd, CONN_PUBLISH, 0);
+
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec its = { .it_interval = { 0, REACTOR_TICK_ms * 1000000L }, .it_value = { 0, REACTOR_TICK_ms * 1000000L } };
+    timerfd_settime(timer_fd, 0, &its, NULL);
+    conn_add(timer_fd, CONN_TIMER, 0);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (sock_listen) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Error waiting epoll");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            Conn *c = (Conn *)events[i].data.ptr;
+            uint32_t ev = events[i].events;
+            switch (c->kind) {
+            case CONN_LISTEN:
+                on_accept(c);
+                break;
+            case CONN_PENDING:
+            case CONN_CTRL:
+            case CONN_DISP:
+                if (ev & EPOLLOUT) conn_flush(c);
+                if (c->kind != CONN_FREE && (ev & (EPOLLIN | EPOLLERR | EPOLLHUP))) on_conn_read(c);
+                break;
+            case CONN_METRICS:
+                if (ev & EPOLLOUT) metrics_flush(c);
+                if (c->kind != CONN_FREE && (ev & (EPOLLIN | EPOLLERR | EPOLLHUP))) metrics_read(c);
+                break;
+            case CONN_PUBLISH:
+                on_publish();
+                break;
+            case CONN_TIMER: {
+                uint64_t expirations;
+                read(c->fd, &expirations, sizeof(expirations));
+                udp_tick();
+                clock_tick(now_ns());
+                metrics_tick(now_ns());
+                break;
+            }
+            case CONN_UDP:
+                on_udp_read(c);
+                break;
+            }
+        }
+    }
+
+    // 소켓 연결 종료
+    for (int i = 0; i < MAX_CONN; i++) {
+        if (conns[i].kind == CONN_FREE || conns[i].kind == CONN_PUBLISH || conns[i].kind == CONN_UDP) continue;
+        if (conns[i].kind == CONN_DISP) conn_flush(&conns[i]);
+        if (conns[i].kind != CONN_FREE) conn_close(&conns[i]);
+    }
+    close(udp_fd);
+    close(epoll_fd);
+    pthread_exit(NULL);
+}
+
+/* handle_console()
+ * 0번 방의 콘솔 출력 쓰레드
+ * SCHED_IDLE로 낮춰 다른 쓰레드가 쉴 때만 돌고, 게시된 상태가 바뀌었을 때만 다시 그린다
+ */
+void *handle_console(void *arg) {
+    StateSnapshot *snap = (StateSnapshot *)arg;
+    static Console con;
+    GameState state;
+    unsigned last_seq = 0;
+
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    uint64_t deadline = now_ns();
+    while (sock_listen) {
+        deadline += 1000000000ULL / CONSOLE_FPS;
+        sleep_until(deadline);
+
+        // 게임 시작 전이나 상태가 그대로면 건너뜀
+        if (atomic_load(&snap->seq) == last_seq) continue;
+        last_seq = read_state(snap, &state, NULL);
+        render_console(&con, &state);
+        flush_console(&con);
+    }
+    pthread_exit(NULL);
+}
+
+/* 헤드리스 벤치마크
+ * 소켓, 디스플레이, 실시간 대기 없이 update_game만 최대 속도로 반복
+ * 입력은 별도 시드의 난수로 만들어 입력 큐를 거쳐 get_input에 들어간다
+ * 경기가 끝나면 다음 시드로 새 경기를 시작하고, 마지막에 상태 해시를 출력
+ */
+#define BENCH_FRAMES 10000000 // 기본 벤치마크 프레임 수
+#define BENCH_SEED 1          // 기본 시드
+
+// FNV-1a
+uint64_t hash_int(uint64_t h, int64_t v) {
+    for (int i = 0; i < 8; i++) {
+        h ^= (v >> (i * 8)) & 0xFF;
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+uint64_t hash_player(uint64_t h, const Player *p) {
+    h = hash_int(h, p->h);
+    h = hash_int(h, p->w);
+    h = hash_int(h, p->paddle_len);
+    h = hash_int(h, p->paddle_v);
+    h = hash_int(h, p->paddle_reflect);
+    h = hash_int(h, p->ult_cnt);
+    return hash_int(h, p->score);
+}
+
+uint64_t hash_state(uint64_t h, const GameState *state) {
+    h = hash_int(h, state->frame);
+    h = hash_int(h, state->gameover);
+    h = hash_int(h, (int64_t)state->rng);
+    h = hash_int(h, state->ball.h);
+    h = hash_int(h, state->ball.w);
+    h = hash_int(h, state->ball.vh);
+    h = hash_int(h, state->ball.vw);
+    h = hash_int(h, state->ball.boost_cnt);
+    h = hash_player(h, &state->player1);
+    return hash_player(h, &state->player2);
+}
+
+InputQueue bench_queue[2];
+
+int run_bench(long frames, uint64_t seed) {
+    GameState state;
+    uint64_t input_rng = seed ^ 0x5DEECE66DULL;
+    InputEvent in[2] = { 0 };
+    PlayerInput tick[2];
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    long matches = 1;
+
+    init_game(&state, seed);
+    uint64_t start = now_ns();
+    for (long i = 0; i < frames; i++) {
+        if (state.gameover) {
+            hash = hash_state(hash, &state);
+            init_game(&state, seed + matches++);
+        }
+        bot_input(&input_rng, &in[0], &bench_queue[0], 1);
+        bot_input(&input_rng, &in[1], &bench_queue[1], 2);
+        get_input(bench_queue, tick);
+        update_game(&state, tick);
+    }
+    uint64_t elapsed = now_ns() - start;
+    hash = hash_state(hash, &state);
+
+    printf("== bench ==\n");
+    printf("seed: %llu frames: %ld matches: %ld\n", (unsigned long long)seed, frames, matches);
+    printf("elapsed: %.3fs fps: %.0f ns/tick: %.1f\n", elapsed / 1e9, frames / (elapsed / 1e9), (double)elapsed / (frames ? frames : 1));
+    printf("score: %d, %d\n", state.player1.score, state.player2.score);
+    printf("hash: %016llx\n", (unsigned long long)hash);
+    return 0;
+}
+
+/* run_replay()
+ * 기록 파일을 실시간 대기 없이 다시 돌려 체크포인트마다 기록과 같은 상태인지 확인
+ * frame을 주면 (0 이상) 체크포인트 색인으로 그 프레임의 상태만 찾아 출력
+ */
+int run_replay(Replay *rp, int frame) {
+    GameState state;
+    uint64_t start = now_ns();
+    if (frame >= 0) {
+        int ok = replay_seek(rp, frame, &state) == 0;
+        uint64_t elapsed = now_ns() - start;
+        if (!ok) printf("record ends at frame %d\n", state.frame);
+        printf("frame: %d sec: %d (seek %.3fms)\n", state.frame, state.frame / GAME_FPS, elapsed / 1e6);
+        printf("ball: [%d, %d] v(%d, %d) boost: %d\n", state.ball.h, state.ball.w, state.ball.vh, state.ball.vw, state.ball.boost_cnt);
+        const Player *players[2] = { &state.player1, &state.player2 };
+        for (int i = 0; i < 2; i++)
+            printf("player%d: [%d, %d] len: %d v: %d reflect: %d ult: %d score: %d\n", i + 1, players[i]->h, players[i]->w,
+                   players[i]->paddle_len, players[i]->paddle_v, players[i]->paddle_reflect, players[i]->ult_cnt, players[i]->score);
+        return ok ? 0 : 1;
+    }
+
+    PlayerInput in[2];
+    long frames = 0;
+    replay_seek(rp, 0, &state);
+    while (replay_next(rp, &state, in) == 0) {
+        update_game(&state, in);
+        frames++;
+    }
+    uint64_t elapsed = now_ns() - start;
+    int broken = rp->pos < rp->end; // 끝까지 못 읽음
+
+    printf("== replay ==\n");
+    if (broken) printf("broken record at offset %zu (frame %d)\n", rp->pos, state.frame);
+    printf("seed: %llu frames: %ld checkpoints: %lu diverged: %lu\n", (unsigned long long)rp->hdr.seed, frames, rp->checked, rp->diverged);
+    printf("elapsed: %.3fs fps: %.0f (x%.0f real time)\n", elapsed / 1e9, frames / (elapsed / 1e9),
+           frames * (double)FRAME_TIME_ns / (elapsed ? elapsed : 1));
+    printf("score: %d, %d\n", state.player1.score, state.player2.score);
+    printf("hash: %016llx\n", (unsigned long long)hash_state(0xCBF29CE484222325ULL, &state));
+    return rp->diverged || broken ? 1 : 0;
+}
+
+/* wait_connections()
+ * 0번 방에 컨트롤러와 디스플레이가 모두 연결될 때까지 접속 현황 출력
+ */
+void wait_connections(Room *r) {
+    int connect_cnt = 0;
+    while (atomic_load(&r->phase) == ROOM_WAIT) {
+        int ctrl1_connect = DISABLE_SOCK || r->replay || atomic_load(&r->ctrl_connect[0]);
+        int ctrl2_connect = DISABLE_SOCK || r->replay || atomic_load(&r->ctrl_connect[1]);
+        int disp_connect = DISABLE_DISP || STAT_GET(r->disp_count) > 0;
+        printf("\033[H\033[J"); // 화면 클리어
+
+        if (!ctrl1_connect) {
+            printf("Waiting for controller 1");
+            for (int i = 0; i < connect_cnt % 6; i++) {
+                printf(".");
+            }
             printf("\n");
         } else {
             printf("controller 1 connected\n");
-#if DISABLE_LCD == 0
-            lcdLoc(LINE1);
-            typeln("CTRL1 CONN");
-#endif
         }
 
         if (!ctrl2_connect) {
             printf("Waiting for controller 2");
-#if DISABLE_LCD == 0
-            lcdLoc(LINE2);
-            typeln("WAIT CTRL2");
-#endif
             for (int i = 0; i < connect_cnt % 6; i++) {
                 printf(".");
             }
             printf("\n");
         } else {
             printf("controller 2 connected\n");
-#if DISABLE_LCD == 0
-            lcdLoc(LINE2);
-            typeln("CTRL2 CONN");
-#endif
         }
         if (!disp_connect) {
             printf("Waiting for dot matrix");
@@ -620,32 +2882,161 @@ int main(void) {
         } else {
             printf("dot matrix connected\n");
         }
+        lcd_post(ctrl1_connect ? "CTRL1 CONN" : "WAIT CTRL1", ctrl2_connect ? "CTRL2 CONN" : "WAIT CTRL2");
         connect_cnt++;
         usleep(500000);
-        lcd_clear();
     };
+}
 
-    // 게임 초기화
-    init_game(&state);
+/* report_throughput()
+ * 다중 경기 모드, 1초마다 진행 중인 경기 수와 처리량 출력
+ */
+void report_throughput(void) {
+    uint64_t last_ticks = 0, last = now_ns();
+    while (1) {
+        sleep(1);
+        uint64_t ticks = 0, now = now_ns();
+        int playing = 0;
+        uint64_t matches = 0;
+        for (int i = 0; i < room_count; i++) {
+            ticks += STAT_GET(rooms[i].ticks);
+            matches += STAT_GET(rooms[i].matches);
+            playing += atomic_load(&rooms[i].phase) == ROOM_PLAY;
+        }
+        double rate = (ticks - last_ticks) / ((now - last) / 1e9);
+        printf("rooms playing: %d/%d ticks/s: %.0f (%.1f per match) matches done: %llu\n", playing, room_count, rate,
+               playing ? rate / playing : 0.0, (unsigned long long)matches);
+        fflush(stdout);
+        last_ticks = ticks;
+        last = now;
+    }
+}
 
-    // 게임 루프
-    while (!state.gameover) {
-        update_game(&state);
-        if (DISABLE_DISP && DISPLAY_CONSOLE) render_console(&state);
-        usleep(FRAME_TIME_us);
-    };
+int main(int argc, char **argv) {
+    // 헤드리스 벤치마크: ./game --bench [프레임 수] [시드]
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+        long frames = argc >= 3 ? atol(argv[2]) : BENCH_FRAMES;
+        uint64_t seed = argc >= 4 ? strtoull(argv[3], NULL, 0) : BENCH_SEED;
+        return run_bench(frames, seed);
+    }
 
-    // 소켓 연결 종료
-    sock_listen = 0;
+    // 다중 경기 모드: ./game --rooms N [--workers M] [--bots]
+    // 경기 기록: ./game --record DIR, 재생: ./game --replay FILE [--seek FRAME] [--display]
+    const char *replay_path = NULL;
+    int replay_frame = -1, replay_display = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rooms") == 0 && i + 1 < argc) {
+            room_count = atoi(argv[++i]);
+            serve_forever = 1;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bots") == 0) {
+            bot_mode = 1;
+            serve_forever = 1;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_dir = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--seek") == 0 && i + 1 < argc) {
+            replay_frame = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--display") == 0) {
+            replay_display = 1;
+        } else {
+            printf("Usage : %s [--rooms N] [--workers M] [--bots] [--record DIR] | --bench [frames] [seed]\n", argv[0]);
+            printf("        %s --replay FILE [--seek FRAME] [--display]\n", argv[0]);
+            exit(1);
+        }
+    }
+    static Replay replay;
+    if (replay_path) {
+        if (replay_open(&replay, replay_path) < 0) exit(1);
+        if (!replay_display) return run_replay(&replay, replay_frame);
+        // 0번 방 한 경기로 재생하며 디스플레이에 실시간으로 보낸다
+        replay.start_frame = replay_frame > 0 ? replay_frame : 0;
+        rooms[0].replay = &replay;
+        room_count = 1;
+        serve_forever = 0;
+        record_dir = NULL;
+    }
+    if (room_count < 1 || room_count > MAX_ROOMS) {
+        printf("rooms must be 1..%d\n", MAX_ROOMS);
+        exit(1);
+    }
+    if (worker_count < 1) worker_count = 1;
+    if (worker_count > room_count) worker_count = room_count;
 
-    if (!DISABLE_SOCK) {
-        // 쓰레드 종료 대기
-        pthread_join(ctrl1_thread, NULL);
-        pthread_join(ctrl2_thread, NULL);
+// LCD 출력시만 사용
+#if DISABLE_LCD == 0
+    if (wiringPiSetup() == -1) exit(1);
+    // LCD init
+    lcd_fd = wiringPiI2CSetup(I2C_ADDR);
+    lcd_init();
+#endif
+
+    publish_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (publish_fd < 0) {
+        perror("Error creating publish eventfd");
+        exit(1);
     }
-    if (!DISABLE_DISP) {
-        pthread_join(disp_thread, NULL);
+    for (int i = 0; i < room_count; i++) {
+        rooms[i].id = i;
+        rooms[i].last_slot = -1;
+    }
+
+    // 쓰레드 종료 플래그 초기화
+    sock_listen = 1;
+
+    // 쓰레드 생성
+    pthread_t net_thread, lcd_thread;
+    if (pthread_create(&net_thread, NULL, handle_net, NULL) < 0) {
+        perror("Error creating thread for network");
+        exit(1);
     }
+    if (pthread_create(&lcd_thread, NULL, handle_lcd, NULL) < 0) {
+        perror("Error creating thread for scoreboard");
+        exit(1);
+    }
+    pthread_t console_thread;
+    int console = DISPLAY_CONSOLE && !serve_forever;
+    if (console && pthread_create(&console_thread, NULL, handle_console, (void *)&rooms[0].pub) < 0) {
+        perror("Error creating thread for console");
+        exit(1);
+    }
+    Worker workers[MAX_ROOMS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < worker_count; i++) {
+        workers[i].id = i;
+        workers[i].cpu = i % (cpus > 0 ? cpus : 1);
+        if (pthread_create(&workers[i].thread, NULL, handle_worker, (void *)&workers[i]) < 0) {
+            perror("Error creating worker thread");
+            exit(1);
+        }
+    }
+
+    if (serve_forever) report_throughput(); // 반환하지 않음
+
+    // 0번 방 한 경기만 진행
+    Room *r = &rooms[0];
+    wait_connections(r);
+    while (atomic_load(&r->phase) != ROOM_OVER)
+        usleep(100000);
+    sleep(ROOM_REST_s); // 결과 표시
+
+    // 소켓 연결 종료
+    sock_listen = 0;
+
+    // 쓰레드 종료 대기
+    for (int i = 0; i < worker_count; i++)
+        pthread_join(workers[i].thread, NULL);
+    pthread_join(net_thread, NULL);
+    pthread_join(lcd_thread, NULL);
+    if (console) pthread_join(console_thread, NULL);
+
+    printf("seed: %llu\n", (unsigned long long)r->seed);
+    loop_dump(&r->clk);
+    input_dump(r->input);
+    trace_dump(r);
+    lcd_dump((r->clk.finish - r->clk.start) / 1e9);
 
     return 0;
 }
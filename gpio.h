@@ -0,0 +1,232 @@
+#ifndef GPIO_H
+#define GPIO_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/gpio.h>
+
+/* 컨트롤러용 GPIO 입출력
+ *
+ * 리눅스 GPIO 문자 장치(uAPI v2)로 라인을 요청하고, 입력은 양쪽 에지 이벤트를 커널 타임스탬프와 함께 받는다
+ * 문자 장치를 쓸 수 없으면 sysfs로 돌아가되 value 파일을 한 번만 열어두고 poll(POLLPRI)로 에지를 기다린다
+ * 어느 쪽이든 핀이 바뀔 때까지 잠들 수 있으므로 값을 계속 읽는 루프가 필요 없다
+ *
+ * 장치 경로는 gpio_setup()이나 환경 변수 GPIO_CHIP, GPIO_SYSFS로 바꿀 수 있다 (gpio-sim 등 가상 칩 시험용)
+ */
+#define GPIO_CHIP_DEFAULT "/dev/gpiochip0"
+#define GPIO_SYSFS_DEFAULT "/sys/class/gpio"
+#define GPIO_CONSUMER "pingpong"
+#define GPIO_PATH_MAX 96
+#define GPIO_EVENT_BUF 16 // 커널에 쌓아둘 에지 이벤트 수
+
+enum { GPIO_CHARDEV, GPIO_SYSFS };
+
+typedef struct {
+    int backend;       // GPIO_CHARDEV, GPIO_SYSFS
+    int fd;            // 문자 장치면 라인 요청 fd, sysfs면 value fd
+    int pin;
+    int output;
+    int value;         // 마지막으로 확인한 값
+    uint64_t ts_ns;    // 마지막 에지 시각 (CLOCK_MONOTONIC), sysfs면 깨어난 시각
+    unsigned long rises; // 상승 에지 수
+    unsigned long falls; // 하강 에지 수
+} GpioLine;
+
+static const char *gpio_chip_path;
+static const char *gpio_sysfs_root;
+
+static inline uint64_t gpio_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* gpio_setup()
+ * 사용할 GPIO 칩과 sysfs 경로 지정, NULL이면 환경 변수나 기본값
+ */
+static inline void gpio_setup(const char *chip, const char *sysfs) {
+    if (!chip) chip = getenv("GPIO_CHIP");
+    if (!sysfs) sysfs = getenv("GPIO_SYSFS");
+    gpio_chip_path = chip ? chip : GPIO_CHIP_DEFAULT;
+    gpio_sysfs_root = sysfs ? sysfs : GPIO_SYSFS_DEFAULT;
+}
+
+static inline int gpio_sysfs_write(const char *file, const char *value) {
+    char path[GPIO_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", gpio_sysfs_root, file);
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) return -1;
+    int ok = write(fd, value, strlen(value)) >= 0;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+static inline int gpio_chardev_open(GpioLine *l, int pin, int output, int value) {
+    int chip = open(gpio_chip_path, O_RDWR | O_CLOEXEC);
+    if (chip < 0) return -1;
+
+    struct gpio_v2_line_request req;
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = pin;
+    req.num_lines = 1;
+    req.event_buffer_size = GPIO_EVENT_BUF;
+    snprintf(req.consumer, sizeof(req.consumer), "%s", GPIO_CONSUMER);
+    if (output) {
+        req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+        req.config.num_attrs = 1;
+        req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+        req.config.attrs[0].attr.values = value ? 1 : 0;
+        req.config.attrs[0].mask = 1;
+    } else {
+        req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    }
+    int ret = ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req);
+    close(chip);
+    if (ret < 0) return -1;
+
+    l->backend = GPIO_CHARDEV;
+    l->fd = req.fd;
+    return 0;
+}
+
+static inline int gpio_sysfs_open(GpioLine *l, int pin, int output) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%d", pin);
+    gpio_sysfs_write("export", buf); // 이미 export 돼 있으면 실패해도 됨
+
+    // export 직후에는 udev가 권한을 바꾸기 전이라 잠시 실패할 수 있다
+    snprintf(buf, sizeof(buf), "gpio%d/direction", pin);
+    int retry = 0;
+    while (gpio_sysfs_write(buf, output ? "out" : "in") < 0) {
+        if (++retry > 20) return -1;
+        usleep(10000);
+    }
+    if (!output) {
+        snprintf(buf, sizeof(buf), "gpio%d/edge", pin);
+        gpio_sysfs_write(buf, "both");
+    }
+
+    char path[GPIO_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/gpio%d/value", gpio_sysfs_root, pin);
+    l->fd = open(path, (output ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (l->fd < 0) return -1;
+    l->backend = GPIO_SYSFS;
+    return 0;
+}
+
+/* gpio_read()
+ * 현재 핀 값 읽기, 파일을 다시 열지 않는다
+ * 반환값: 0, 1, 오류면 -1
+ */
+static inline int gpio_read(GpioLine *l) {
+    if (l->backend == GPIO_CHARDEV) {
+        struct gpio_v2_line_values v = { .bits = 0, .mask = 1 };
+        if (ioctl(l->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &v) < 0) return -1;
+        return l->value = (int)(v.bits & 1);
+    }
+    char c;
+    if (pread(l->fd, &c, 1, 0) != 1) return -1;
+    return l->value = c == '1';
+}
+
+/* gpio_write()
+ * 출력 라인 값 쓰기
+ */
+static inline int gpio_write(GpioLine *l, int value) {
+    l->value = !!value;
+    if (l->backend == GPIO_CHARDEV) {
+        struct gpio_v2_line_values v = { .bits = (uint64_t)l->value, .mask = 1 };
+        return ioctl(l->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &v) < 0 ? -1 : 0;
+    }
+    return pwrite(l->fd, value ? "1" : "0", 1, 0) == 1 ? 0 : -1;
+}
+
+/* gpio_open()
+ * 핀을 입력(에지 이벤트) 또는 출력으로 요청, 문자 장치가 안 되면 sysfs 사용
+ * 반환값: 성공하면 0
+ */
+static inline int gpio_open(GpioLine *l, int pin, int output, int value) {
+    if (!gpio_chip_path) gpio_setup(NULL, NULL);
+    memset(l, 0, sizeof(*l));
+    l->pin = pin;
+    l->output = output;
+    l->fd = -1;
+    if (gpio_chardev_open(l, pin, output, value) < 0 && gpio_sysfs_open(l, pin, output) < 0) {
+        fprintf(stderr, "Failed to open gpio %d\n", pin);
+        return -1;
+    }
+    l->ts_ns = gpio_now_ns();
+    if (output) return gpio_write(l, value);
+    return gpio_read(l) < 0 ? -1 : 0;
+}
+
+static inline void gpio_close(GpioLine *l) {
+    if (l->fd < 0) return;
+    close(l->fd);
+    l->fd = -1;
+    if (l->backend == GPIO_SYSFS) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%d", l->pin);
+        gpio_sysfs_write("unexport", buf);
+    }
+}
+
+// poll()에서 기다릴 이벤트
+static inline short gpio_poll_events(const GpioLine *l) {
+    return l->backend == GPIO_CHARDEV ? POLLIN : POLLPRI | POLLERR;
+}
+
+/* gpio_handle()
+ * poll()이 알려준 에지 하나 처리, value와 ts_ns 갱신
+ * 반환값: 처리한 에지 수 (0, 1), 오류면 -1
+ */
+static inline int gpio_handle(GpioLine *l) {
+    if (l->backend == GPIO_CHARDEV) {
+        // 에지마다 시각이 필요하므로 한 번에 하나씩, 남은 이벤트는 poll()이 다시 알려준다
+        struct gpio_v2_line_event ev;
+        ssize_t n = read(l->fd, &ev, sizeof(ev));
+        if (n < 0) return errno == EAGAIN ? 0 : -1;
+        if (n != sizeof(ev)) return 0;
+        l->value = ev.id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+        l->ts_ns = ev.timestamp_ns;
+        if (l->value)
+            l->rises++;
+        else
+            l->falls++;
+        return 1;
+    }
+
+    // sysfs는 값을 다시 읽어야 다음 에지를 받을 수 있다
+    int before = l->value;
+    if (gpio_read(l) < 0) return -1;
+    l->ts_ns = gpio_now_ns();
+    if (l->value == before) return 0;
+    if (l->value)
+        l->rises++;
+    else
+        l->falls++;
+    return 1;
+}
+
+/* gpio_wait()
+ * 입력 핀에 에지가 올 때까지 대기, timeout_ms가 음수면 무한 대기
+ * 반환값: 처리한 에지 수 (0, 1), 시간 초과면 0, 오류면 -1
+ */
+static inline int gpio_wait(GpioLine *l, int timeout_ms) {
+    struct pollfd pfd = { l->fd, gpio_poll_events(l), 0 };
+    int n;
+    while ((n = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR)
+        ;
+    if (n <= 0) return n;
+    return gpio_handle(l);
+}
+
+#endif
@@ -0,0 +1,476 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* 컨트롤러 -> 서버 바이너리 프로토콜 v2
+ *
+ * 헤더 8바이트, 여러 바이트 값은 네트워크 바이트 순서
+ * [ver(4bit)|type(4bit)][len][seq(16)][ts_us(32)]
+ *   ver   : PROTO_VERSION
+ *   type  : PROTO_INPUT 등
+ *   len   : 헤더 포함 패킷 전체 길이
+ *   seq   : 보낸 쪽 패킷 순번
+ *   ts_us : 보낸 시각, 보낸 쪽 CLOCK_MONOTONIC 마이크로초 하위 32비트
+ *
+ * PROTO_INPUT 본문: 샘플 N개, 샘플당 6바이트
+ * [buttons][aux][axis(16)][age_us(16)]
+ *   buttons : PROTO_BTN_* 비트
+ *   aux     : PROTO_BTN_RCV와 함께 컨트롤러1 초음파로 추정한 움직임 속도, PROTO_AUX_SPEED_STEP 단위 (255에서 고정), 그 외 0
+ *             0이면 서버는 최대 세기로 본다 (속도를 보내지 않는 컨트롤러)
+ *   axis    : 아날로그 막대 속도, PROTO_AXIS_ONE이 기본 막대 속도 1배, ±PROTO_AXIS_MAX까지
+ *   age_us  : ts_us보다 몇 마이크로초 전에 측정한 샘플인지
+ *
+ * 첫 바이트가 0x20~0x2F라서 기존 ASCII 형식("0000", 숫자 4개)과 구분된다
+ *
+ * UDP로 보낼 때는 데이터그램 하나에 패킷 하나
+ *   - 서버의 PROTO_UDP_PORT로 PROTO_HELLO를 보내고, 서버가 같은 HELLO를 되돌려주면 등록된 것
+ *   - 받는 쪽은 seq가 마지막으로 받은 것보다 새롭지 않은 데이터그램을 버린다 (순서 뒤바뀜, 중복)
+ *   - 컨트롤러는 최근 PROTO_UDP_REDUNDANCY개 샘플을 매번 다시 싣고, 입력이 그대로여도 PROTO_UDP_RESEND_ms마다 보낸다
+ *     i번째 샘플의 순번은 seq - (N - 1 - i)로 보고 이미 받은 샘플은 버린다
+ *   - 디스플레이 프레임은 항상 키프레임이고, 서버는 마지막 프레임을 주기적으로 같은 seq로 다시 보낸다
+ *     PROTO_DISP_MOTION이 붙으면 같은 데이터그램에 이어서 싣는다
+ *   - PROTO_UDP_TIMEOUT_ms 동안 아무것도 받지 못하면 서버는 등록을 지운다, 디스플레이는 HELLO를 다시 보내 유지
+ *
+ * 시각 동기화 (NTP 방식)
+ *   서버가 접속 직후와 그 뒤 주기적으로 PROTO_PING을 보낸다, ts_us = t1 (서버 시계)
+ *   클라이언트는 받은 즉시 seq를 그대로 담아 PROTO_PONG으로 답한다, 본문 t1, t2 = 받은 시각, ts_us = t3 = 보낸 시각
+ *   서버는 받은 시각 t4로 왕복 시간 (t4 - t1) - (t3 - t2)와 시계 차이 ((t2 - t1) + (t3 - t4)) / 2를 구해
+ *   클라이언트 시각(ts_us, 출력 완료 시각)을 서버 시계로 옮긴다
+ */
+#define PROTO_VERSION 2
+#define PROTO_HEADER_SIZE 8
+#define PROTO_SAMPLE_SIZE 6
+#define PROTO_MAX_SAMPLES 16
+#define PROTO_MAX_PACKET (PROTO_HEADER_SIZE + PROTO_SAMPLE_SIZE * PROTO_MAX_SAMPLES)
+
+// 패킷 종류
+#define PROTO_INPUT 1      // 컨트롤러 입력 샘플
+#define PROTO_DISP_KEY 2   // 디스플레이 키프레임
+#define PROTO_DISP_DELTA 3 // 디스플레이 변경분 프레임
+#define PROTO_HELLO 4      // 접속 직후 방과 역할 지정 [room][role]
+#define PROTO_DISP_MOTION 5 // 공의 정밀 좌표와 속도 (디스플레이 보간용)
+#define PROTO_DISP_ACK 6    // 디스플레이 -> 서버 출력 완료 알림
+#define PROTO_PING 7        // 서버 -> 클라이언트 시각 동기화 요청
+#define PROTO_PONG 8        // 클라이언트 -> 서버 시각 동기화 응답 [t1(32)][t2(32)]
+
+// PROTO_HELLO 역할
+#define PROTO_ROLE_CTRL1 1
+#define PROTO_ROLE_CTRL2 2
+#define PROTO_ROLE_DISP 3
+#define PROTO_HELLO_SIZE (PROTO_HEADER_SIZE + 2)
+#define PROTO_PING_SIZE PROTO_HEADER_SIZE
+#define PROTO_PONG_SIZE (PROTO_HEADER_SIZE + 8)
+
+// 버튼 비트
+#define PROTO_BTN_UP 0x01
+#define PROTO_BTN_DOWN 0x02
+#define PROTO_BTN_ULT 0x04 // 궁극기
+#define PROTO_BTN_RCV 0x08 // 초음파 반사
+
+#define PROTO_AXIS_ONE 256 // axis 값 1배
+#define PROTO_AXIS_MAX (2 * PROTO_AXIS_ONE) // 최대 막대 속도, 이보다 큰 값은 잘라낸다
+#define PROTO_AUX_SPEED_STEP 25 // aux 한 단계의 초음파 속도 (cm/s)
+#define PROTO_LEGACY_LEN 4 // 기존 ASCII 메시지 길이
+
+#define PROTO_UDP_PORT 8090        // UDP 수신 포트 (로비 포트와 같은 번호)
+#define PROTO_UDP_REDUNDANCY 3     // 패킷마다 다시 싣는 최근 샘플 수
+#define PROTO_UDP_RESEND_ms 50     // 입력이 그대로일 때 UDP로 보내는 주기
+#define PROTO_UDP_KEEPALIVE_ms 1000 // 디스플레이가 HELLO를 다시 보내는 주기
+#define PROTO_UDP_TIMEOUT_ms 3000  // 이 시간 동안 조용하면 등록 해제
+#define PROTO_UDP_RETRY 3          // HELLO 응답을 기다리는 횟수, 모두 실패하면 TCP 사용
+
+typedef struct {
+    uint8_t type;
+    uint8_t len;
+    uint16_t seq;
+    uint32_t ts_us;
+} ProtoHeader;
+
+typedef struct {
+    uint8_t buttons;
+    uint8_t aux;
+    int16_t axis;
+    uint16_t age_us;
+} ProtoSample;
+
+// 보낼 샘플 모음, 한 패킷으로 묶어서 전송
+typedef struct {
+    uint16_t seq;
+    int count;
+    ProtoSample sample[PROTO_MAX_SAMPLES];
+    uint32_t t_us[PROTO_MAX_SAMPLES]; // 샘플 측정 시각
+} ProtoBatch;
+
+/* 서버 -> 디스플레이 프레임
+ * 헤더는 컨트롤러 프로토콜과 같고 seq는 프레임 순번, ts_us는 서버 전송 시각
+ *
+ * PROTO_DISP_KEY   : 필드 DISP_FIELDS개 전체
+ * PROTO_DISP_DELTA : [mask(16)] + mask에 켜진 필드만 번호 순서대로
+ *
+ * 키프레임은 접속 직후, 프레임을 버린 뒤, DISP_KEY_INTERVAL 프레임마다 보낸다
+ * 화면이 바뀌지 않으면 아무것도 보내지 않는다
+ *
+ * PROTO_DISP_MOTION : [tick(32)][tick_us(16)][scale(16)][h(16)][w(16)][vh(16)][vw(16)]
+ *   서버가 켜두면 키프레임, 공 궤적이 바뀐 프레임, 숨겼던 공이 다시 나타난 프레임 바로 뒤에 붙고, seq는 앞 프레임과 같다
+ *   TCP에서는 화면이 그대로여도 궤적이 바뀌면 혼자 온다
+ *   tick    : 서버 게임 프레임 번호, 경기가 새로 시작하면 0부터
+ *   tick_us : 게임 프레임 간격
+ *   scale   : 도트 하나의 내부 단위 크기
+ *   h, w    : 공 좌표 (내부 단위), vh, vw : 게임 프레임당 공 속도 (내부 단위)
+ *   디스플레이는 다음 PROTO_DISP_MOTION이 올 때까지 이것으로 공 위치를 외삽한다, 모르는 클라이언트는 무시하면 된다
+ *
+ * 디스플레이 -> 서버 PROTO_DISP_ACK : [age_us(32)]
+ *   새 프레임을 도트 매트릭스에 출력할 때마다 보낸다, seq는 출력한 프레임 순번, ts_us는 출력을 마친 시각
+ *   age_us : 프레임을 받은 뒤 출력을 마칠 때까지 걸린 시간
+ */
+#define DISP_FIELDS 9
+#define DISP_KEY_INTERVAL 30  // 키프레임 간격 (전송 프레임 수)
+#define DISP_FLAG_HIDE_BALL 0x01 // 공 숨김 (궁극기)
+
+enum { DISP_BALL_H, DISP_BALL_W, DISP_P1_H, DISP_P1_W, DISP_P1_LEN, DISP_P2_H, DISP_P2_W, DISP_P2_LEN, DISP_FLAGS };
+
+typedef struct {
+    uint8_t f[DISP_FIELDS]; // 도트 단위 좌표, DISP_* 순서
+} DispFrame;
+
+#define DISP_MOTION_SIZE (PROTO_HEADER_SIZE + 16)
+#define DISP_ACK_SIZE (PROTO_HEADER_SIZE + 4)
+
+typedef struct {
+    uint32_t tick;
+    uint16_t tick_us;
+    uint16_t scale;
+    int16_t h, w;
+    int16_t vh, vw;
+} DispMotion;
+
+typedef struct {
+    uint16_t seq;
+    int since_key; // 마지막 키프레임 이후 보낸 프레임 수
+    int force_key; // 다음 프레임은 무조건 키프레임
+    DispFrame last; // 마지막으로 보낸 화면
+} DispEncoder;
+
+typedef struct {
+    DispFrame cur;
+    int synced;    // 키프레임을 받아 cur가 유효한지
+    uint16_t seq;  // 마지막으로 받은 순번
+    unsigned long missed; // 순번으로 확인한 놓친 프레임 수
+} DispDecoder;
+
+static inline uint32_t proto_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+static inline void proto_put16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void proto_put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline uint16_t proto_get16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t proto_get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline int proto_put_header(uint8_t *p, uint8_t type, int len, uint16_t seq, uint32_t ts_us) {
+    p[0] = PROTO_VERSION << 4 | (type & 0x0F);
+    p[1] = len;
+    proto_put16(p + 2, seq);
+    proto_put32(p + 4, ts_us);
+    return PROTO_HEADER_SIZE;
+}
+
+/* proto_batch_add()
+ * 측정 시각과 함께 샘플 추가
+ * 반환값: 추가 후 샘플 수, 가득 차 있으면 -1
+ */
+static inline int proto_batch_add(ProtoBatch *b, const ProtoSample *s, uint32_t t_us) {
+    if (b->count >= PROTO_MAX_SAMPLES) return -1;
+    b->sample[b->count] = *s;
+    b->t_us[b->count] = t_us;
+    return ++b->count;
+}
+
+/* proto_batch_encode()
+ * 모인 샘플을 PROTO_INPUT 패킷 하나로 인코딩하고 비운다
+ * out은 PROTO_MAX_PACKET 이상
+ * 반환값: 패킷 길이
+ */
+static inline int proto_batch_encode(ProtoBatch *b, uint8_t *out, uint32_t now_us) {
+    int len = PROTO_HEADER_SIZE + b->count * PROTO_SAMPLE_SIZE;
+    uint8_t *p = out + proto_put_header(out, PROTO_INPUT, len, b->seq++, now_us);
+    for (int i = 0; i < b->count; i++, p += PROTO_SAMPLE_SIZE) {
+        uint32_t age = now_us - b->t_us[i];
+        p[0] = b->sample[i].buttons;
+        p[1] = b->sample[i].aux;
+        proto_put16(p + 2, (uint16_t)b->sample[i].axis);
+        proto_put16(p + 4, age > 0xFFFF ? 0xFFFF : age);
+    }
+    b->count = 0;
+    return len;
+}
+
+/* proto_batch_encode_redundant()
+ * UDP용 인코딩, 보낸 뒤에도 최근 keep개 샘플을 남겨 다음 패킷에 다시 싣는다
+ * 패킷마다 새 샘플을 하나씩 추가해야 받는 쪽이 샘플 순번을 알 수 있다
+ * 반환값: 패킷 길이
+ */
+static inline int proto_batch_encode_redundant(ProtoBatch *b, uint8_t *out, uint32_t now_us, int keep) {
+    int count = b->count;
+    int len = proto_batch_encode(b, out, now_us);
+    int drop = count > keep ? count - keep : 0;
+    memmove(b->sample, b->sample + drop, (count - drop) * sizeof(b->sample[0]));
+    memmove(b->t_us, b->t_us + drop, (count - drop) * sizeof(b->t_us[0]));
+    b->count = count - drop;
+    return len;
+}
+
+// UDP로 받은 순번이 마지막 순번보다 새로운지
+static inline int proto_seq_newer(uint16_t seq, uint16_t last) {
+    return (int16_t)(seq - last) > 0;
+}
+
+/* proto_hello()
+ * 방 번호와 역할을 알리는 PROTO_HELLO 패킷 인코딩
+ * 반환값: 패킷 길이
+ */
+static inline int proto_hello(uint8_t *out, int room, int role) {
+    proto_put_header(out, PROTO_HELLO, PROTO_HELLO_SIZE, 0, proto_now_us());
+    out[PROTO_HEADER_SIZE] = room;
+    out[PROTO_HEADER_SIZE + 1] = role;
+    return PROTO_HELLO_SIZE;
+}
+
+/* proto_udp_hello()
+ * connect()된 UDP 소켓으로 PROTO_HELLO를 보내고 서버가 되돌려줄 때까지 대기
+ * 응답이 없으면 PROTO_UDP_RETRY번까지 다시 보낸다
+ * 반환값: 등록되면 0, 실패하면 -1 (TCP로 접속하면 된다)
+ */
+static inline int proto_udp_hello(int sock, int room, int role) {
+    uint8_t pkt[PROTO_HELLO_SIZE], ack[PROTO_MAX_PACKET];
+    for (int i = 0; i < PROTO_UDP_RETRY; i++) {
+        if (write(sock, pkt, proto_hello(pkt, room, role)) < 0 && errno != ECONNREFUSED) return -1;
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        while (poll(&pfd, 1, PROTO_UDP_KEEPALIVE_ms / PROTO_UDP_RETRY) > 0) {
+            ssize_t n = read(sock, ack, sizeof(ack));
+            if (n < 0) break; // 서버가 없으면 ECONNREFUSED
+            if (n == PROTO_HELLO_SIZE && ack[0] >> 4 == PROTO_VERSION && (ack[0] & 0x0F) == PROTO_HELLO && ack[PROTO_HEADER_SIZE] == room && ack[PROTO_HEADER_SIZE + 1] == role) return 0;
+        }
+    }
+    return -1;
+}
+
+/* proto_pong()
+ * 받은 PROTO_PING에 대한 응답 인코딩
+ * t_recv는 PING을 받은 시각
+ * 반환값: 패킷 길이
+ */
+static inline int proto_pong(uint8_t *out, const uint8_t *ping, uint32_t t_recv) {
+    proto_put_header(out, PROTO_PONG, PROTO_PONG_SIZE, proto_get16(ping + 2), proto_now_us());
+    memcpy(out + PROTO_HEADER_SIZE, ping + 4, 4);
+    proto_put32(out + PROTO_HEADER_SIZE + 4, t_recv);
+    return PROTO_PONG_SIZE;
+}
+
+/* proto_parse()
+ * buf 앞부분의 v2 패킷 헤더 해석
+ * 반환값: 패킷 전체 길이, 데이터가 더 필요하면 0, 올바른 패킷이 아니면 -1
+ */
+static inline int proto_parse(const uint8_t *buf, int n, ProtoHeader *h) {
+    if (n < 1) return 0;
+    if (buf[0] >> 4 != PROTO_VERSION) return -1;
+    if (n < 2) return 0;
+    if (buf[1] < PROTO_HEADER_SIZE) return -1;
+    h->type = buf[0] & 0x0F;
+    h->len = buf[1];
+    if (h->type == PROTO_INPUT && ((h->len - PROTO_HEADER_SIZE) % PROTO_SAMPLE_SIZE || h->len > PROTO_MAX_PACKET)) return -1;
+    if (h->type == PROTO_HELLO && h->len != PROTO_HELLO_SIZE) return -1;
+    if (h->type == PROTO_DISP_KEY && h->len != PROTO_HEADER_SIZE + DISP_FIELDS) return -1;
+    if (h->type == PROTO_DISP_DELTA && (h->len < PROTO_HEADER_SIZE + 2 || h->len > PROTO_HEADER_SIZE + 2 + DISP_FIELDS)) return -1;
+    if (h->type == PROTO_DISP_MOTION && h->len != DISP_MOTION_SIZE) return -1;
+    if (h->type == PROTO_DISP_ACK && h->len != DISP_ACK_SIZE) return -1;
+    if (h->type == PROTO_PING && h->len != PROTO_PING_SIZE) return -1;
+    if (h->type == PROTO_PONG && h->len != PROTO_PONG_SIZE) return -1;
+    if (n < h->len) return 0;
+    h->seq = proto_get16(buf + 2);
+    h->ts_us = proto_get32(buf + 4);
+    return h->len;
+}
+
+/* proto_reply_pings()
+ * 서버에서 받은 데이터 중 PROTO_PING에 답하고 나머지는 버린다
+ * 서버에서 받을 것이 시각 동기화뿐인 컨트롤러용, 잘린 패킷은 다음 호출까지 rx에 남긴다
+ */
+static inline void proto_reply_pings(int sock, uint8_t *rx, int *rx_len, uint32_t t_recv) {
+    int i = 0;
+    while (i < *rx_len) {
+        ProtoHeader h;
+        int len = proto_parse(rx + i, *rx_len - i, &h);
+        if (len == 0) break;
+        if (len < 0) {
+            i++;
+            continue;
+        }
+        if (h.type == PROTO_PING) {
+            uint8_t pong[PROTO_PONG_SIZE];
+            if (write(sock, pong, proto_pong(pong, rx + i, t_recv)) < 0) break;
+        }
+        i += len;
+    }
+    memmove(rx, rx + i, *rx_len - i);
+    *rx_len -= i;
+}
+
+static inline int proto_sample_count(const ProtoHeader *h) {
+    return (h->len - PROTO_HEADER_SIZE) / PROTO_SAMPLE_SIZE;
+}
+
+static inline void proto_get_sample(const uint8_t *pkt, int i, ProtoSample *s) {
+    const uint8_t *p = pkt + PROTO_HEADER_SIZE + i * PROTO_SAMPLE_SIZE;
+    s->buttons = p[0];
+    s->aux = p[1];
+    s->axis = (int16_t)proto_get16(p + 2);
+    s->age_us = proto_get16(p + 4);
+}
+
+/* disp_encode()
+ * 이전에 보낸 화면과 비교해 키프레임 또는 변경분 프레임 인코딩
+ * out은 PROTO_HEADER_SIZE + 2 + DISP_FIELDS 이상
+ * 반환값: 패킷 길이, 보낼 필요가 없으면 0
+ */
+static inline int disp_encode(DispEncoder *e, const DispFrame *f, uint8_t *out, uint32_t now_us) {
+    uint16_t mask = 0;
+    for (int i = 0; i < DISP_FIELDS; i++)
+        if (f->f[i] != e->last.f[i]) mask |= 1 << i;
+    if (!mask && !e->force_key) return 0;
+
+    int len;
+    if (e->force_key || e->since_key >= DISP_KEY_INTERVAL) {
+        len = PROTO_HEADER_SIZE + DISP_FIELDS;
+        proto_put_header(out, PROTO_DISP_KEY, len, e->seq, now_us);
+        memcpy(out + PROTO_HEADER_SIZE, f->f, DISP_FIELDS);
+        e->since_key = 0;
+        e->force_key = 0;
+    } else {
+        uint8_t *p = out + PROTO_HEADER_SIZE;
+        proto_put16(p, mask);
+        p += 2;
+        for (int i = 0; i < DISP_FIELDS; i++)
+            if (mask & (1 << i)) *p++ = f->f[i];
+        len = p - out;
+        proto_put_header(out, PROTO_DISP_DELTA, len, e->seq, now_us);
+    }
+    e->seq++;
+    e->since_key++;
+    e->last = *f;
+    return len;
+}
+
+/* disp_decode()
+ * 받은 디스플레이 프레임을 현재 화면에 반영
+ * 순번이 건너뛰면 다음 키프레임까지 변경분 프레임은 버린다
+ * 반환값: 화면이 갱신되면 1
+ */
+static inline int disp_decode(DispDecoder *d, const uint8_t *pkt, const ProtoHeader *h) {
+    if (h->type != PROTO_DISP_KEY && h->type != PROTO_DISP_DELTA) return 0;
+    if (d->synced && h->seq != (uint16_t)(d->seq + 1)) {
+        d->missed += (uint16_t)(h->seq - d->seq - 1);
+        d->synced = 0;
+    }
+    d->seq = h->seq;
+
+    const uint8_t *p = pkt + PROTO_HEADER_SIZE;
+    if (h->type == PROTO_DISP_KEY) {
+        memcpy(d->cur.f, p, DISP_FIELDS);
+        d->synced = 1;
+        return 1;
+    }
+    if (!d->synced) return 0;
+
+    uint16_t mask = proto_get16(p);
+    const uint8_t *end = pkt + h->len;
+    p += 2;
+    for (int i = 0; i < DISP_FIELDS && p < end; i++)
+        if (mask & (1 << i)) d->cur.f[i] = *p++;
+    return 1;
+}
+
+/* disp_motion_encode()
+ * 공 좌표와 속도를 PROTO_DISP_MOTION 패킷으로 인코딩
+ * 반환값: 패킷 길이
+ */
+static inline int disp_motion_encode(const DispMotion *m, uint8_t *out, uint16_t seq, uint32_t now_us) {
+    uint8_t *p = out + proto_put_header(out, PROTO_DISP_MOTION, DISP_MOTION_SIZE, seq, now_us);
+    proto_put32(p, m->tick);
+    proto_put16(p + 4, m->tick_us);
+    proto_put16(p + 6, m->scale);
+    proto_put16(p + 8, (uint16_t)m->h);
+    proto_put16(p + 10, (uint16_t)m->w);
+    proto_put16(p + 12, (uint16_t)m->vh);
+    proto_put16(p + 14, (uint16_t)m->vw);
+    return DISP_MOTION_SIZE;
+}
+
+static inline void disp_motion_decode(const uint8_t *pkt, DispMotion *m) {
+    const uint8_t *p = pkt + PROTO_HEADER_SIZE;
+    m->tick = proto_get32(p);
+    m->tick_us = proto_get16(p + 4);
+    m->scale = proto_get16(p + 6);
+    m->h = (int16_t)proto_get16(p + 8);
+    m->w = (int16_t)proto_get16(p + 10);
+    m->vh = (int16_t)proto_get16(p + 12);
+    m->vw = (int16_t)proto_get16(p + 14);
+}
+
+/* disp_ack()
+ * 프레임 출력 완료 알림 인코딩
+ * 반환값: 패킷 길이
+ */
+static inline int disp_ack(uint8_t *out, uint16_t seq, uint32_t age_us) {
+    proto_put_header(out, PROTO_DISP_ACK, DISP_ACK_SIZE, seq, proto_now_us());
+    proto_put32(out + PROTO_HEADER_SIZE, age_us);
+    return DISP_ACK_SIZE;
+}
+
+// 기존 ASCII 메시지의 시작 바이트인지
+static inline int proto_is_legacy(uint8_t c) {
+    return c >= '0' && c <= '9';
+}
+
+/* proto_legacy_sample()
+ * 기존 형식 "0000" [UP][DOWN][궁극기][초음파]을 샘플로 변환
+ * 컨트롤러2는 UP/DOWN 자리에 속도 단계(0~2)를 보내므로 axis로 옮긴다
+ */
+static inline void proto_legacy_sample(const uint8_t *msg, ProtoSample *s) {
+    memset(s, 0, sizeof(*s));
+    s->axis = ((msg[1] - '0') - (msg[0] - '0')) * PROTO_AXIS_ONE;
+    if (msg[2] == '1') s->buttons |= PROTO_BTN_ULT;
+    if (msg[3] == '1') s->buttons |= PROTO_BTN_RCV;
+}
+
+// 샘플의 막대 속도 (PROTO_AXIS_ONE 단위)
+static inline int proto_sample_axis(const ProtoSample *s) {
+    int dir = !!(s->buttons & PROTO_BTN_DOWN) - !!(s->buttons & PROTO_BTN_UP);
+    int axis = s->axis + dir * PROTO_AXIS_ONE;
+    return axis > PROTO_AXIS_MAX ? PROTO_AXIS_MAX : axis < -PROTO_AXIS_MAX ? -PROTO_AXIS_MAX : axis;
+}
+
+#endif